@@ -0,0 +1,720 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for doas's hot paths: parsing the configuration,
+ * matching a command against it, building the new environment, finding
+ * the session a persistent authentication token is for, checking and
+ * refreshing the token, and finding a user's password hash. Each runs
+ * in-process against synthetic input and reports the time and the number
+ * of heap allocations per operation, except for contend, which runs many
+ * token checks at once in separate processes and reports latency, and
+ * startup, which times running the doas binary in the build tree.
+ *
+ * usage: bench [name ...]
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../bsd-compat/compat.h"
+#include "../doas.h"
+#include "../persist.h"
+#include "../shadowauth.h"
+#include "statlines.h"
+#ifdef DOAS_PERSIST_DAEMON
+#include "../doasd.h"
+#endif
+
+#define MINTIME		200000000ULL	/* run each case for 0.2s */
+#define CONTEND_OPS	200		/* operations per process */
+
+void yyinput(int, const char *);
+int yyparse(void);
+void freerules(void);
+
+static unsigned long long allocs;
+
+#ifdef __GLIBC__
+/* count allocations by interposing on the allocator */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *
+malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	allocs++;
+	return __libc_realloc(p, size);
+}
+#define HAVE_ALLOCS	1
+#else
+#define HAVE_ALLOCS	0
+#endif
+
+static unsigned long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+report(const char *name, const char *param, unsigned long long ns,
+    unsigned long long nallocs, unsigned long long ops)
+{
+	if (HAVE_ALLOCS)
+		printf("%-8s %-24s %14.1f ns/op %12.1f allocs/op\n", name,
+		    param, (double)ns / ops, (double)nallocs / ops);
+	else
+		printf("%-8s %-24s %14.1f ns/op\n", name, param,
+		    (double)ns / ops);
+	fflush(stdout);
+}
+
+static void
+reportlat(const char *name, const char *param, unsigned long long p50,
+    unsigned long long p99)
+{
+	printf("%-8s %-24s %14.1f ns p50 %12.1f ns p99\n", name, param,
+	    (double)p50, (double)p99);
+	fflush(stdout);
+}
+
+static int
+rmentry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* remove a state directory made by a benchmark, and everything in it */
+static void
+rmstate(const char *dir)
+{
+	if (nftw(dir, rmentry, 16, FTW_DEPTH | FTW_PHYS) == -1)
+		warn("%s", dir);
+}
+
+/*
+ * Write a configuration of nrules rules spread over ngroups groups to a
+ * temporary file, returning a descriptor for it. Rules are a mix of user
+ * and group identities, targets, commands and arguments, as generated
+ * policies tend to be.
+ */
+static int
+genconfig(int nrules, int ngroups)
+{
+	FILE *fp;
+	int i;
+
+	if ((fp = tmpfile()) == NULL)
+		err(1, "tmpfile");
+	for (i = 0; i < nrules; i++) {
+		switch (i % 4) {
+		case 0:
+			fprintf(fp, "permit nopass :%d as %d cmd /usr/bin/tool%d"
+			    " args --flag value%d\n", 1000 + i % ngroups,
+			    i % 7, i % 300, i);
+			break;
+		case 1:
+			fprintf(fp, "permit persist setenv { -ENV PS1=$X FOO }"
+			    " :%d cmd /usr/bin/tool%d\n", 1000 + i % ngroups,
+			    i % 300);
+			break;
+		case 2:
+			fprintf(fp, "deny %d as root cmd /usr/bin/tool%d\n",
+			    2000 + i % 1000, i % 300);
+			break;
+		case 3:
+			fprintf(fp, "permit keepenv :%d # comment %d\n",
+			    1000 + i % ngroups, i);
+			break;
+		}
+	}
+	if (fflush(fp) == EOF)
+		err(1, "tmpfile");
+	return fileno(fp);
+}
+
+static void
+loadconfig(int fd)
+{
+	freerules();
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		err(1, "lseek");
+	yyinput(fd, NULL);
+	yyparse();
+	if (parse_error)
+		errx(1, "parse error");
+	compilerules();
+}
+
+static void
+benchparse(void)
+{
+	static const int sizes[] = { 10, 100, 1000, 10000, 100000 };
+	unsigned long long start, a, ops;
+	char param[64];
+	size_t i;
+	int fd;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fd = genconfig(sizes[i], 100);
+		a = allocs;
+		start = now();
+		for (ops = 0; ops == 0 || now() - start < MINTIME; ops++)
+			loadconfig(fd);
+		snprintf(param, sizeof(param), "rules=%d", sizes[i]);
+		report("parse", param, now() - start, allocs - a, ops);
+		close(fd);
+	}
+}
+
+static void
+benchpermit(void)
+{
+	static const int sizes[] = { 10, 1000, 100000 };
+	static const int ngroups[] = { 1, 10, 100, 1000 };
+	static const char *args[] = { "--flag", "value4", NULL };
+	const struct rule *rule;
+	unsigned long long start, a, ops;
+	gid_t groups[1000];
+	char param[64];
+	size_t i, j;
+	int fd, k;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fd = genconfig(sizes[i], 1000);
+		loadconfig(fd);
+		for (j = 0; j < sizeof(ngroups) / sizeof(ngroups[0]); j++) {
+			for (k = 0; k < ngroups[j]; k++)
+				groups[k] = 1000 + k;
+			a = allocs;
+			start = now();
+			for (ops = 0; ops == 0 || now() - start < MINTIME;
+			    ops++)
+				permit(3000, groups, ngroups[j], &rule, 4,
+				    "/usr/bin/tool4", args);
+			snprintf(param, sizeof(param), "rules=%d groups=%d",
+			    sizes[i], ngroups[j]);
+			report("permit", param, now() - start, allocs - a, ops);
+		}
+		close(fd);
+	}
+}
+
+static void
+benchenv(void)
+{
+	static const int sizes[] = { 10, 100, 1000, 10000 };
+	static const char *envlist[] = {
+		"-ENV", "PS1=$DOAS_PS1", "SSH_AUTH_SOCK", "FOO=bar", NULL
+	};
+	extern char **environ;
+	unsigned long long start, a, ops;
+	struct passwd pw;
+	struct rule rule;
+	char **saved, **env, **envp, param[64];
+	size_t i;
+	int j;
+
+	memset(&pw, 0, sizeof(pw));
+	pw.pw_name = "root";
+	pw.pw_dir = "/root";
+	pw.pw_shell = "/bin/sh";
+	memset(&rule, 0, sizeof(rule));
+	rule.options = KEEPENV;
+	rule.envlist = envlist;
+	formerpath = "/bin:/usr/bin";
+
+	saved = environ;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (!(env = calloc(sizes[i] + 2, sizeof(*env))))
+			err(1, NULL);
+		env[0] = "PATH=/bin:/usr/bin";
+		for (j = 1; j <= sizes[i]; j++)
+			if (asprintf(&env[j], "VAR%d=value of variable %d",
+			    j, j) == -1)
+				err(1, NULL);
+		environ = env;
+
+		a = allocs;
+		start = now();
+		for (ops = 0; ops == 0 || now() - start < MINTIME; ops++) {
+			envp = prepenv(&rule, &pw, &pw);
+			for (j = 0; envp[j]; j++)
+				free(envp[j]);
+			free(envp);
+		}
+		environ = saved;
+		snprintf(param, sizeof(param), "vars=%d", sizes[i]);
+		report("prepenv", param, now() - start, allocs - a, ops);
+	}
+}
+
+static void
+benchprocstat(void)
+{
+	unsigned long long start, total, a, ops, starttime;
+	size_t i, n = sizeof(statlines) / sizeof(statlines[0]);
+	size_t *lens;
+	char name[PATH_MAX];
+	int ttynr;
+
+	if ((lens = reallocarray(NULL, n, sizeof(*lens))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++)
+		lens[i] = strlen(statlines[i].line);
+
+	a = allocs;
+	total = 0;
+	for (ops = 0; total < MINTIME; ops++) {
+		start = now();
+		for (i = 0; i < n; i++)
+			(void)parsestat(statlines[i].line, lens[i], &ttynr,
+			    &starttime);
+		total += now() - start;
+	}
+	report("procstat", "parse corpus line", total, allocs - a, ops * n);
+
+	a = allocs;
+	start = now();
+	for (ops = 0; ops == 0 || now() - start < MINTIME; ops++)
+		if (procstat(getpid(), &ttynr, &starttime) == -1)
+			errx(1, "procstat failed");
+	report("procstat", "read and parse", now() - start, allocs - a, ops);
+
+	a = allocs;
+	start = now();
+	for (ops = 0; ops == 0 || now() - start < MINTIME; ops++)
+		if (gettsfilename(name, sizeof(name)) == -1)
+			errx(1, "gettsfilename failed");
+	report("procstat", "gettsfilename", now() - start, allocs - a, ops);
+	free(lens);
+}
+
+#ifdef DOAS_PERSIST_DAEMON
+/* Start doasd from the build tree on the state directory dir, and wait
+   until it answers. */
+static pid_t
+startdoasd(const char *dir)
+{
+	struct sockaddr_un sun;
+	pid_t pid;
+	int fd, i;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s", dir,
+	    DOASD_SOCKET);
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		execl("./doasd", "doasd", "-d", dir, (char *)NULL);
+		err(1, "./doasd");
+	}
+	for (i = 0; i < 1000; i++) {
+		if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+			err(1, "socket");
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+			close(fd);
+			return pid;
+		}
+		close(fd);
+		usleep(1000);
+	}
+	errx(1, "doasd did not start");
+}
+#endif
+
+/*
+ * Check and refresh a token with the persist backend doas was built with,
+ * in a state directory on disk and in one on a tmpfs. Tokens are either
+ * new each time or still valid, as with a first and a later doas call in
+ * a session. The keyring backend keeps no state directory, so for it both
+ * measure the same thing.
+ */
+static void
+benchpersist(void)
+{
+	static const struct {
+		const char *name;
+		const char *parent;
+		int isvolatile;
+		int daemon;
+	} modes[] = {
+		{ "durable", "/var/tmp", 0, 0 },
+		{ "volatile", "/dev/shm", 1, 0 },
+#ifdef DOAS_PERSIST_DAEMON
+		{ "doasd", "/var/tmp", 0, 1 },
+#endif
+	};
+	static const struct {
+		const char *name;
+		int fresh;
+		int refresh;
+	} cases[] = {
+		{ "new", 1, 0 },
+		{ "valid", 0, 0 },
+		{ "valid refresh=60", 0, 60 },
+	};
+	unsigned long long start, total, a, ops, stamped;
+	struct persist ps;
+	char dir[64], param[64];
+	size_t i, c;
+	int rv;
+#ifdef DOAS_PERSIST_DAEMON
+	pid_t pid;
+#endif
+
+	if (geteuid() != 0) {
+		printf("persist  skipped, needs root\n");
+		return;
+	}
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		snprintf(dir, sizeof(dir), "%s/doas-bench.XXXXXX",
+		    modes[i].parent);
+		if (mkdtemp(dir) == NULL) {
+			printf("persist  %s skipped, %s unusable\n",
+			    modes[i].name, modes[i].parent);
+			continue;
+		}
+		persist_state_dir = dir;
+		persist_volatile = modes[i].isvolatile;
+#ifdef DOAS_PERSIST_DAEMON
+		pid = modes[i].daemon ? startdoasd(dir) : -1;
+#endif
+
+		for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+			persist_refresh = cases[c].refresh;
+			a = allocs;
+			total = stamped = 0;
+			start = now();
+			for (ops = 0; ops == 0 || now() - start < MINTIME;
+			    ops++) {
+				if (cases[c].fresh)
+					persist_clear(PERSIST_TTY);
+				total -= now();
+				rv = persist_check(&ps, DOAS_PERSIST_TIMEOUT,
+				    PERSIST_TTY);
+				if (rv == PERSIST_ERROR)
+					errx(1, "persist_check failed in %s",
+					    dir);
+				if (persist_update(&ps) == PERSIST_STAMPED)
+					stamped++;
+				if (rv == PERSIST_NEW)
+					persist_commit(&ps);
+				total += now();
+			}
+			snprintf(param, sizeof(param), "%s %s", modes[i].name,
+			    cases[c].name);
+			report("persist", param, total, allocs - a, ops);
+			if (cases[c].refresh)
+				printf("%-8s %-24s %14llu of %llu writes "
+				    "avoided\n", "persist", param,
+				    ops - stamped, ops);
+		}
+		persist_refresh = DOAS_PERSIST_REFRESH;
+
+#ifdef DOAS_PERSIST_DAEMON
+		if (pid != -1) {
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+		}
+#endif
+		rmstate(dir);
+	}
+}
+
+static int
+cmplat(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Start n processes at once, each in a session of its own and either all
+ * as the same user or each as a different one, which check and refresh a
+ * persistent authentication token CONTEND_OPS times, and report the median
+ * and 99th percentile latency of doing so.
+ */
+static void
+contend(int n, int peruser, int fresh)
+{
+	unsigned long long *lat, start;
+	struct persist ps;
+	size_t nlat = (size_t)n * CONTEND_OPS;
+	char c, param[64];
+	int fds[2], i, j, rv, status;
+
+	lat = mmap(NULL, nlat * sizeof(*lat), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (lat == MAP_FAILED)
+		err(1, "mmap");
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+
+	for (i = 0; i < n; i++) {
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(fds[1]);
+			if (setsid() == -1)
+				err(1, "setsid");
+			if (peruser && setresuid(10000 + i, 0, 0) == -1)
+				err(1, "setresuid");
+			if (!fresh) {
+				rv = persist_check(&ps, DOAS_PERSIST_TIMEOUT,
+				    PERSIST_TTY);
+				if (rv == PERSIST_ERROR)
+					errx(1, "persist_check failed");
+				(void)persist_update(&ps);
+				if (rv == PERSIST_NEW)
+					persist_commit(&ps);
+			}
+			/* wait until every process has been started */
+			(void)read(fds[0], &c, 1);
+			for (j = 0; j < CONTEND_OPS; j++) {
+				if (fresh)
+					persist_clear(PERSIST_TTY);
+				start = now();
+				rv = persist_check(&ps, DOAS_PERSIST_TIMEOUT,
+				    PERSIST_TTY);
+				if (rv == PERSIST_ERROR)
+					errx(1, "persist_check failed");
+				(void)persist_update(&ps);
+				if (rv == PERSIST_NEW)
+					persist_commit(&ps);
+				lat[i * CONTEND_OPS + j] = now() - start;
+			}
+			persist_clear(PERSIST_TTY);
+			_exit(0);
+		}
+	}
+	close(fds[0]);
+	close(fds[1]);
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(1, "contending process failed");
+
+	qsort(lat, nlat, sizeof(*lat), cmplat);
+	snprintf(param, sizeof(param), "%s %d %s",
+	    peruser ? "per-user" : "one-user", n, fresh ? "new" : "valid");
+	reportlat("contend", param, lat[nlat / 2], lat[nlat * 99 / 100]);
+	munmap(lat, nlat * sizeof(*lat));
+}
+
+static void
+benchcontend(void)
+{
+	static const int nprocs[] = { 1, 16, 128 };
+	char dir[64];
+	size_t i;
+	int fresh, peruser;
+
+	if (geteuid() != 0) {
+		printf("contend  skipped, needs root\n");
+		return;
+	}
+	strlcpy(dir, "/var/tmp/doas-bench.XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	persist_state_dir = dir;
+	persist_volatile = 0;
+
+	for (peruser = 0; peruser <= 1; peruser++)
+		for (fresh = 1; fresh >= 0; fresh--)
+			for (i = 0; i < sizeof(nprocs) / sizeof(nprocs[0]); i++)
+				contend(nprocs[i], peruser, fresh);
+
+	rmstate(dir);
+}
+
+/*
+ * Time running ./doas to check a nopass rule with -C, which takes no
+ * password, as a stand-in for an invocation which needs none: most of
+ * it is spent starting the process and loading its libraries. Build doas
+ * with and without LAZY_CRYPT to compare.
+ */
+static void
+benchstartup(void)
+{
+	char conf[] = "/tmp/doas-bench.XXXXXX";
+	unsigned long long start, ops;
+	pid_t pid;
+	int fd, status;
+
+	if (access("./doas", X_OK) == -1) {
+		printf("startup  skipped, no ./doas\n");
+		return;
+	}
+	if ((fd = mkstemp(conf)) == -1)
+		err(1, "mkstemp");
+	dprintf(fd, "permit nopass %u\n", getuid());
+	close(fd);
+
+	start = now();
+	for (ops = 0; ops == 0 || now() - start < MINTIME; ops++) {
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0) {
+			if ((fd = open("/dev/null", O_WRONLY)) == -1 ||
+			    dup2(fd, STDOUT_FILENO) == -1)
+				err(1, "/dev/null");
+			execl("./doas", "doas", "-C", conf, "true", (char *)NULL);
+			err(1, "./doas");
+		}
+		if (waitpid(pid, &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(1, "./doas -C %s true failed", conf);
+	}
+	report("startup", "doas -C nopass", now() - start, 0, ops);
+
+	unlink(conf);
+}
+
+/*
+ * Find the hash of the last user in a shadow file of n users, as the
+ * files backend of NSS does, by parsing every line before theirs with
+ * fgetspent(), and as shadowscan() does.
+ */
+static void
+shadow(int n)
+{
+	char path[] = "/tmp/doas-bench.XXXXXX", param[32], last[32];
+	unsigned long long start, ops;
+	struct spwd *spw;
+	FILE *fp;
+	char *hash;
+	int fd, i;
+
+	if ((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+		err(1, "mkstemp");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "svc%06d:$6$%016d$%086d:20000:0:99999:7:::\n",
+		    i, i, i);
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+	snprintf(last, sizeof(last), "svc%06d", n - 1);
+
+	snprintf(param, sizeof(param), "fgetspent %d users", n);
+	start = now();
+	allocs = 0;
+	for (ops = 0; ops == 0 || now() - start < MINTIME; ops++) {
+		if ((fp = fopen(path, "r")) == NULL)
+			err(1, "%s", path);
+		while ((spw = fgetspent(fp)) != NULL)
+			if (strcmp(spw->sp_namp, last) == 0)
+				break;
+		if (spw == NULL)
+			errx(1, "fgetspent: %s not found", last);
+		fclose(fp);
+	}
+	report("shadow", param, now() - start, allocs, ops);
+
+	shadow_file = path;
+	snprintf(param, sizeof(param), "scan %d users", n);
+	start = now();
+	allocs = 0;
+	for (ops = 0; ops == 0 || now() - start < MINTIME; ops++) {
+		if ((hash = shadowscan(last)) == NULL)
+			errx(1, "shadowscan: %s not found", last);
+		shadowwipe(hash);
+	}
+	report("shadow", param, now() - start, allocs, ops);
+
+	unlink(path);
+}
+
+static void
+benchshadow(void)
+{
+	static const int nusers[] = { 100, 10000, 50000 };
+	size_t i;
+
+	for (i = 0; i < sizeof(nusers) / sizeof(nusers[0]); i++)
+		shadow(nusers[i]);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} benches[] = {
+	{ "parse", benchparse },
+	{ "permit", benchpermit },
+	{ "prepenv", benchenv },
+	{ "procstat", benchprocstat },
+	{ "persist", benchpersist },
+	{ "contend", benchcontend },
+	{ "startup", benchstartup },
+	{ "shadow", benchshadow },
+};
+
+int
+main(int argc, char **argv)
+{
+	size_t i;
+	int j;
+
+	setprogname("bench");
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		for (j = 1; j < argc; j++)
+			if (strcmp(argv[j], benches[i].name) == 0)
+				break;
+		if (argc == 1 || j < argc)
+			benches[i].fn();
+	}
+	return 0;
+}
@@ -0,0 +1,895 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Checks of doas's internals against known answers, run by make check.
+ * Randomized checks use a fixed seed, which is printed with any failure
+ * so that it can be reproduced.
+ *
+ * usage: check [name ...]
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../bsd-compat/compat.h"
+#include "../doas.h"
+#include "../persist.h"
+#include "statlines.h"
+#ifdef DOAS_PERSIST_DAEMON
+#include "../doasd.h"
+#endif
+
+#define MATCHCONFIGS	500	/* random configurations to compare */
+#define MATCHQUERIES	200	/* queries against each of them */
+
+void yyinput(int, const char *);
+int yyparse(void);
+void freerules(void);
+
+static int failed, skipped;
+static int ptymaster;
+
+static void
+fail(const char *name, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "check: %s: ", name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	failed = 1;
+}
+
+/* xorshift64, so that a seed gives the same configurations everywhere */
+static uint64_t rngstate;
+
+static unsigned int
+rnd(unsigned int n)
+{
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return rngstate % n;
+}
+
+#define PICK(a)	((a)[rnd(sizeof(a) / sizeof((a)[0]))])
+
+/*
+ * The linear matcher doas used before the rules were compiled into a
+ * tree: every rule is checked in turn, names are looked up as they are
+ * met, and the last matching rule wins.
+ */
+static int
+refuid(const char *s, uid_t *uid)
+{
+	struct passwd *pw;
+	const char *errstr;
+
+	if ((pw = getpwnam(s)) != NULL) {
+		*uid = pw->pw_uid;
+		return *uid == UID_MAX ? -1 : 0;
+	}
+	*uid = strtonum(s, 0, UID_MAX - 1, &errstr);
+	return errstr ? -1 : 0;
+}
+
+static int
+refgid(const char *s, gid_t *gid)
+{
+	struct group *gr;
+	const char *errstr;
+
+	if ((gr = getgrnam(s)) != NULL) {
+		*gid = gr->gr_gid;
+		return *gid == GID_MAX ? -1 : 0;
+	}
+	*gid = strtonum(s, 0, GID_MAX - 1, &errstr);
+	return errstr ? -1 : 0;
+}
+
+/*
+ * The names in generated rules come from a handful, so each is looked up
+ * once and its answer kept, rather than reading the passwd and group
+ * databases again for every rule of every query.
+ */
+static struct {
+	char name[32];
+	int group;
+	int rv;
+	id_t id;
+} refnames[32];
+static size_t nrefnames;
+
+static int
+reflookup(const char *s, int group, id_t *id)
+{
+	uid_t uid;
+	gid_t gid;
+	size_t i;
+
+	for (i = 0; i < nrefnames; i++)
+		if (refnames[i].group == group &&
+		    strcmp(refnames[i].name, s) == 0) {
+			*id = refnames[i].id;
+			return refnames[i].rv;
+		}
+	if (i == sizeof(refnames) / sizeof(refnames[0]) ||
+	    strlcpy(refnames[i].name, s, sizeof(refnames[i].name)) >=
+	    sizeof(refnames[i].name))
+		errx(1, "too many names to keep: %s", s);
+	refnames[i].group = group;
+	if (group) {
+		refnames[i].rv = refgid(s, &gid);
+		refnames[i].id = gid;
+	} else {
+		refnames[i].rv = refuid(s, &uid);
+		refnames[i].id = uid;
+	}
+	nrefnames++;
+	*id = refnames[i].id;
+	return refnames[i].rv;
+}
+
+static int
+refmatch(uid_t uid, gid_t *groups, int ngroups, uid_t target,
+    const char *cmd, const char **cmdargs, const struct rule *r)
+{
+	id_t id;
+	int i;
+
+	if (r->ident[0] == ':') {
+		if (reflookup(r->ident + 1, 1, &id) == -1)
+			return 0;
+		for (i = 0; i < ngroups; i++)
+			if (id == groups[i])
+				break;
+		if (i == ngroups)
+			return 0;
+	} else if (reflookup(r->ident, 0, &id) == -1 || id != uid)
+		return 0;
+	if (r->target && (reflookup(r->target, 0, &id) == -1 || id != target))
+		return 0;
+	if (r->cmd) {
+		if (strcmp(r->cmd, cmd))
+			return 0;
+		if (r->cmdargs) {
+			for (i = 0; r->cmdargs[i]; i++)
+				if (!cmdargs[i] ||
+				    strcmp(r->cmdargs[i], cmdargs[i]))
+					return 0;
+			if (cmdargs[i])
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static const struct rule *
+refpermit(uid_t uid, gid_t *groups, int ngroups, uid_t target,
+    const char *cmd, const char **cmdargs)
+{
+	const struct rule *last = NULL;
+	size_t i;
+
+	for (i = 0; i < nrules; i++)
+		if (refmatch(uid, groups, ngroups, target, cmd, cmdargs,
+		    rules[i]))
+			last = rules[i];
+	return last;
+}
+
+/*
+ * Write a random configuration of up to 40 rules to fp. The names and
+ * numbers are drawn from small sets, so that rules overlap and override
+ * each other, and include users and groups which don't exist.
+ */
+static void
+genrules(FILE *fp)
+{
+	static const char *users[] = {
+		"0", "root", "1000", "1001", "1002", "nosuch-check-user"
+	};
+	static const char *groups[] = {
+		":0", ":root", ":1000", ":2000", ":2001", ":nosuch-check-group"
+	};
+	static const char *targets[] = {
+		NULL, NULL, "root", "0", "1000", "nosuch-check-user"
+	};
+	static const char *cmds[] = {
+		NULL, NULL, "/bin/a", "/bin/b", "/bin/c"
+	};
+	static const char *args[] = { "x", "y" };
+	const char *t, *c;
+	int n, i, j, nargs;
+
+	n = 1 + rnd(40);
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s %s", rnd(3) ? "permit" : "deny",
+		    rnd(2) ? PICK(users) : PICK(groups));
+		if ((t = PICK(targets)) != NULL)
+			fprintf(fp, " as %s", t);
+		if ((c = PICK(cmds)) != NULL) {
+			fprintf(fp, " cmd %s", c);
+			/* -1 for no args keyword, 0 for args and nothing */
+			nargs = (int)rnd(4) - 1;
+			if (nargs >= 0)
+				fprintf(fp, " args");
+			for (j = 0; j < nargs; j++)
+				fprintf(fp, " %s", PICK(args));
+		}
+		fprintf(fp, "\n");
+	}
+}
+
+/*
+ * Ask random queries of permit() and of the linear matcher, and fail if
+ * they don't pick the same rule. how says where the rules came from.
+ */
+static void
+matchqueries(uint64_t seed, const char *how)
+{
+	static const uid_t uids[] = { 0, 1000, 1001, 1002, 1003 };
+	static const gid_t gids[] = { 0, 1000, 1001, 2000, 2001 };
+	static const uid_t targets[] = { 0, 1000, 1001 };
+	static const char *cmds[] = { "/bin/a", "/bin/b", "/bin/c", "/bin/d" };
+	static const char *args[] = { "x", "y", "zzz" };
+	const struct rule *want, *got;
+	const char *cmdargs[3];
+	gid_t groups[5];
+	uid_t uid, target;
+	const char *cmd;
+	int i, j, ngroups, nargs, permitted;
+
+	for (i = 0; i < MATCHQUERIES; i++) {
+		uid = PICK(uids);
+		ngroups = rnd(6);
+		for (j = 0; j < ngroups; j++)
+			groups[j] = PICK(gids);
+		target = PICK(targets);
+		cmd = PICK(cmds);
+		nargs = rnd(3);
+		for (j = 0; j < nargs; j++)
+			cmdargs[j] = PICK(args);
+		cmdargs[nargs] = NULL;
+
+		want = refpermit(uid, groups, ngroups, target, cmd, cmdargs);
+		permitted = permit(uid, groups, ngroups, &got, target, cmd,
+		    cmdargs);
+		if (got != want ||
+		    permitted != (want && want->action == PERMIT)) {
+			fail("match", "seed %llu, %s rules, query %d: "
+			    "uid %u target %u %s: got line %ld, want line %ld",
+			    (unsigned long long)seed, how, i, uid, target, cmd,
+			    got ? (long)got->lineno : -1L,
+			    want ? (long)want->lineno : -1L);
+			return;
+		}
+	}
+}
+
+/*
+ * Compare the decision tree with the linear matcher on random
+ * configurations, both as parsed and as loaded from a compiled cache.
+ */
+static void
+checkmatch(void)
+{
+	char path[] = "/tmp/doas-check.XXXXXX", db[PATH_MAX];
+	struct stat sb;
+	uint64_t seed;
+	FILE *fp;
+	int fd;
+
+	for (seed = 1; seed <= MATCHCONFIGS && !failed; seed++) {
+		rngstate = seed * 0x9e3779b97f4a7c15ULL;
+		if ((fd = mkstemp(path)) == -1 ||
+		    (fp = fdopen(fd, "w+")) == NULL)
+			err(1, "mkstemp");
+		genrules(fp);
+		if (fflush(fp) == EOF || fstat(fd, &sb) == -1)
+			err(1, "%s", path);
+
+		freerules();
+		if (lseek(fd, 0, SEEK_SET) == -1)
+			err(1, "lseek");
+		yyinput(fd, NULL);
+		yyparse();
+		if (parse_error)
+			errx(1, "seed %llu: parse error",
+			    (unsigned long long)seed);
+		compilerules();
+		matchqueries(seed, "parsed");
+
+		cache_write(path, &sb, rules, nrules);
+		freerules();
+		if (cache_load(path, &sb, 0) == -1)
+			errx(1, "seed %llu: can't load the compiled rules",
+			    (unsigned long long)seed);
+		compilerules();
+		matchqueries(seed, "cached");
+
+		fclose(fp);
+		unlink(path);
+		snprintf(db, sizeof(db), "%s.db", path);
+		unlink(db);
+		strlcpy(path, "/tmp/doas-check.XXXXXX", sizeof(path));
+	}
+	freerules();
+}
+
+/*
+ * Parse conf as a whole configuration file, with any errors it has kept
+ * off stderr. Returns 0 if it parsed.
+ */
+static int
+parseconf(const char *conf)
+{
+	FILE *fp;
+	int fd, saved;
+
+	if ((fp = tmpfile()) == NULL || fputs(conf, fp) == EOF ||
+	    fflush(fp) == EOF)
+		err(1, "tmpfile");
+	rewind(fp);
+	fflush(stderr);
+	if ((saved = dup(STDERR_FILENO)) == -1 ||
+	    (fd = open("/dev/null", O_WRONLY)) == -1 ||
+	    dup2(fd, STDERR_FILENO) == -1)
+		err(1, "/dev/null");
+	close(fd);
+
+	freerules();
+	yyinput(fileno(fp), NULL);
+	yyparse();
+
+	fflush(stderr);
+	if (dup2(saved, STDERR_FILENO) == -1)
+		err(1, "dup2");
+	close(saved);
+	fclose(fp);
+	return parse_error ? -1 : 0;
+}
+
+/*
+ * Rules and what they parse to: whether they parse, the persist timeout,
+ * the first argument and setenv entry, if any, and the prompt timeout.
+ */
+static const struct {
+	const char *conf;
+	int ok;
+	int persist;
+	const char *arg;
+	const char *env;
+	int prompt;
+} parsecases[] = {
+	{ "permit persist=5 root\n", 1, 5 },
+	{ "permit nolog persist=5 keepenv root\n", 1, 5 },
+	{ "permit persist=0 root\n", 0 },
+	{ "permit persist=yes root\n", 0 },
+	{ "permit persist=-5 root\n", 0 },
+	{ "permit nopass persist=5 root\n", 0 },
+	{ "permit persist=5 persist=6 root\n", 0 },
+	/* anywhere but among the options, it is only a word */
+	{ "permit root cmd foo args persist=yes\n", 1, 0, "persist=yes" },
+	{ "permit root cmd foo args persist=5\n", 1, 0, "persist=5" },
+	{ "permit root as root cmd persist=5\n", 1, 0 },
+	{ "permit setenv { persist=5 } root\n", 1, 0, NULL, "persist=5" },
+	{ "permit persist=5 setenv { persist=6 } root\n", 1, 5, NULL,
+	  "persist=6" },
+	{ "permit \"persist=5\"\n", 1, 0 },
+	{ "permit root\npermit persist=5 root\n", 1, 5 },
+	{ "permit root # persist=5\npermit persist=6 root\n", 1, 6 },
+	/* and so is prompt=N */
+	{ "permit prompt=30 root\n", 1, 0, NULL, NULL, 30 },
+	{ "permit persist=5 prompt=30 root\n", 1, 5, NULL, NULL, 30 },
+	{ "permit prompt=yes root\n", 0 },
+	{ "permit prompt=0 root\n", 0 },
+	{ "permit nopass prompt=30 root\n", 0 },
+	{ "permit prompt=30 prompt=40 root\n", 0 },
+	{ "permit root cmd foo args prompt=yes\n", 1, 0, "prompt=yes" },
+	{ "permit root cmd foo args prompt=30\n", 1, 0, "prompt=30" },
+	{ "permit setenv { prompt=30 } root\n", 1, 0, NULL, "prompt=30" },
+};
+
+/* Check that option words are only taken as such among the options. */
+static void
+checkparse(void)
+{
+	const struct rule *r;
+	size_t i;
+	int ok;
+
+	for (i = 0; i < sizeof(parsecases) / sizeof(parsecases[0]); i++) {
+		ok = parseconf(parsecases[i].conf) == 0;
+		if (ok != parsecases[i].ok) {
+			fail("parse", "case %zu %s parse", i,
+			    ok ? "should not" : "should");
+			continue;
+		}
+		if (!ok)
+			continue;
+		r = rules[nrules - 1];
+		if (r->persist != parsecases[i].persist)
+			fail("parse", "case %zu: persist %d, want %d", i,
+			    r->persist, parsecases[i].persist);
+		if (parsecases[i].arg && (!r->cmdargs || !r->cmdargs[0] ||
+		    strcmp(r->cmdargs[0], parsecases[i].arg) != 0))
+			fail("parse", "case %zu: wrong arguments", i);
+		if (parsecases[i].env && (!r->envlist || !r->envlist[0] ||
+		    strcmp(r->envlist[0], parsecases[i].env) != 0))
+			fail("parse", "case %zu: wrong setenv", i);
+		if (r->prompt != parsecases[i].prompt)
+			fail("parse", "case %zu: prompt %d, want %d", i,
+			    r->prompt, parsecases[i].prompt);
+	}
+	freerules();
+}
+
+/* Check parsestat() against the corpus of stat lines. */
+static void
+checkprocstat(void)
+{
+	unsigned long long starttime;
+	size_t i;
+	int ttynr, ok;
+
+	for (i = 0; i < sizeof(statlines) / sizeof(statlines[0]); i++) {
+		ttynr = -1;
+		starttime = 0;
+		ok = parsestat(statlines[i].line, strlen(statlines[i].line),
+		    &ttynr, &starttime) == 0;
+		if (ok != statlines[i].ok)
+			fail("procstat", "line %zu %s parse", i,
+			    ok ? "should not" : "should");
+		else if (ok && (ttynr != statlines[i].ttynr ||
+		    starttime != statlines[i].starttime))
+			fail("procstat", "line %zu: tty %d start %llu, "
+			    "want tty %d start %llu", i, ttynr, starttime,
+			    statlines[i].ttynr, statlines[i].starttime);
+	}
+}
+
+/*
+ * Run fn in a new session with a pty as its controlling tty, as the
+ * token of a tty session and a password prompt need, and fail if it
+ * fails. The other side of the pty is left in ptymaster.
+ */
+static void
+withtty(void (*fn)(void))
+{
+	int mfd, sfd, status;
+	pid_t pid;
+
+	if ((mfd = posix_openpt(O_RDWR | O_NOCTTY)) == -1 ||
+	    grantpt(mfd) == -1 || unlockpt(mfd) == -1)
+		err(1, "posix_openpt");
+	fflush(stderr);
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		if (setsid() == -1 ||
+		    (sfd = open(ptsname(mfd), O_RDWR)) == -1)
+			err(1, "pty");
+		ptymaster = mfd;
+		fn();
+		fflush(stderr);
+		_exit(failed);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	close(mfd);
+	if (WIFSIGNALED(status))
+		fprintf(stderr, "check: killed by %s\n",
+		    strsignal(WTERMSIG(status)));
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		failed = 1;
+}
+
+/* Whether timeout ms after now has passed, within a tenth of a second */
+static int
+waited(const struct timespec *start, long timeout)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+	return ms >= timeout - 100 && ms <= timeout + 100;
+}
+
+/* Ask for a password at the pty, giving up timeout ms from now. */
+static char *
+ask(char *buf, size_t len, long timeout, struct timespec *start)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, start);
+	deadline = *start;
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += timeout % 1000 * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	} else if (deadline.tv_nsec < 0) {
+		deadline.tv_sec--;
+		deadline.tv_nsec += 1000000000;
+	}
+	return readpassphrase_until("password: ", buf, len,
+	    RPP_REQUIRE_TTY, &deadline);
+}
+
+static void
+prompts(void)
+{
+	struct timespec start;
+	char buf[64], *r;
+	pid_t pid;
+
+	/* a read must not block forever, as it would have with an alarm */
+	alarm(10);
+
+	/* the deadline has passed before the read starts */
+	errno = 0;
+	if ((r = ask(buf, sizeof(buf), -1000, &start)) != NULL ||
+	    errno != ETIMEDOUT || !waited(&start, 0))
+		fail("prompt", "a deadline already passed was missed");
+
+	/* or passes during it */
+	errno = 0;
+	if ((r = ask(buf, sizeof(buf), 500, &start)) != NULL ||
+	    errno != ETIMEDOUT || !waited(&start, 500))
+		fail("prompt", "a deadline during the read was missed");
+
+	/* a password typed in time is taken */
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		usleep(200000);
+		if (write(ptymaster, "secret\n", 7) != 7)
+			_exit(1);
+		_exit(0);
+	}
+	r = ask(buf, sizeof(buf), 2000, &start);
+	waitpid(pid, NULL, 0);
+	if (r == NULL || strcmp(r, "secret") != 0)
+		fail("prompt", "a password given in time was not read");
+
+	alarm(0);
+}
+
+/* Check that a password prompt gives up at its deadline, and only then. */
+static void
+checkprompt(void)
+{
+	withtty(prompts);
+}
+
+#ifdef DOAS_PERSIST_DAEMON
+static int
+rmentry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* remove a state directory made by a check, and everything in it */
+static void
+rmstate(const char *dir)
+{
+	if (nftw(dir, rmentry, 16, FTW_DEPTH | FTW_PHYS) == -1)
+		warn("%s", dir);
+}
+
+/* Start doasd from the build tree on the state directory dir, and wait
+   until it answers. */
+static pid_t
+startdoasd(const char *dir)
+{
+	struct sockaddr_un sun;
+	pid_t pid;
+	int fd, i;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s", dir,
+	    DOASD_SOCKET);
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		execl("./doasd", "doasd", "-d", dir, (char *)NULL);
+		err(1, "./doasd");
+	}
+	for (i = 0; i < 1000; i++) {
+		if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+			err(1, "socket");
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+			close(fd);
+			return pid;
+		}
+		close(fd);
+		usleep(1000);
+	}
+	errx(1, "doasd did not start");
+}
+
+static void
+stopdoasd(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Send the request m to doasd on the state directory dir from a process
+ * running as uid, and read its answer into m. Returns -1 if there was no
+ * answer.
+ */
+static int
+askdoasd(const char *dir, uid_t uid, struct doasd_msg *m)
+{
+	struct sockaddr_un sun;
+	struct timeval tv = { 2, 0 };
+	int p[2], fd, status;
+	pid_t pid;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s", dir,
+	    DOASD_SOCKET);
+
+	if (pipe(p) == -1 || (pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(p[0]);
+		if (uid != 0 && setresuid(uid, uid, uid) == -1)
+			_exit(2);
+		if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1 ||
+		    connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+		    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) == -1 ||
+		    send(fd, m, sizeof(*m), 0) != sizeof(*m) ||
+		    recv(fd, m, sizeof(*m), 0) != sizeof(*m) ||
+		    write(p[1], m, sizeof(*m)) != sizeof(*m))
+			_exit(1);
+		_exit(0);
+	}
+	close(p[1]);
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 2)
+		errx(1, "can't become uid %u", uid);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    read(p[0], m, sizeof(*m)) != sizeof(*m)) {
+		close(p[0]);
+		return -1;
+	}
+	close(p[0]);
+	return 0;
+}
+
+static void
+doasdmsg(struct doasd_msg *m, int op, const char *name)
+{
+	memset(m, 0, sizeof(*m));
+	m->op = op;
+	m->timeout = 60;
+	strlcpy(m->name, name, sizeof(m->name));
+}
+
+/* Check a token, and make it if it is new, as doas does. Returns what
+   persist_check() did, and whether doasd kept the token in indaemon. */
+static int
+usetoken(int *indaemon)
+{
+	struct persist ps;
+	int rv;
+
+	rv = persist_check(&ps, 60, PERSIST_TTY);
+	*indaemon = ps.indaemon;
+	if (rv != PERSIST_ERROR)
+		(void)persist_update(&ps);
+	if (rv == PERSIST_NEW)
+		persist_commit(&ps);
+	return rv;
+}
+
+static void
+fallback(void)
+{
+	int rv, indaemon;
+
+	/* no socket at all */
+	if ((rv = usetoken(&indaemon)) != PERSIST_NEW || indaemon)
+		fail("doasd", "without doasd, a new token was not made in a "
+		    "file (%d, %d)", rv, indaemon);
+	if ((rv = usetoken(&indaemon)) != PERSIST_OK || indaemon)
+		fail("doasd", "without doasd, the token in a file was not "
+		    "used (%d, %d)", rv, indaemon);
+}
+
+static void
+fallbackrefused(void)
+{
+	int rv, indaemon;
+
+	/* a socket left behind, which nothing listens on */
+	if ((rv = usetoken(&indaemon)) != PERSIST_NEW || indaemon)
+		fail("doasd", "with a dead socket, a new token was not made "
+		    "in a file (%d, %d)", rv, indaemon);
+}
+
+static void
+indoasd(void)
+{
+	int rv, indaemon;
+
+	if ((rv = usetoken(&indaemon)) != PERSIST_NEW || !indaemon)
+		fail("doasd", "with doasd running, it was not asked (%d, %d)",
+		    rv, indaemon);
+	if ((rv = usetoken(&indaemon)) != PERSIST_OK || !indaemon)
+		fail("doasd", "with doasd running, its token was not used "
+		    "(%d, %d)", rv, indaemon);
+}
+
+/*
+ * Run doasd on a temporary state directory, and check that it answers
+ * root but nobody else, and that doas keeps tokens in files while it
+ * isn't running.
+ */
+static void
+checkdoasd(void)
+{
+	char dir[] = "/var/tmp/doas-check.XXXXXX", sock[PATH_MAX];
+	struct sockaddr_un sun;
+	struct doasd_msg m;
+	struct passwd *pw;
+	uid_t nobody;
+	pid_t pid;
+	int fd;
+
+	if (geteuid() != 0) {
+		printf("doasd    skipped, needs root\n");
+		skipped = 1;
+		return;
+	}
+	if (access("./doasd", X_OK) == -1) {
+		printf("doasd    skipped, no ./doasd\n");
+		skipped = 1;
+		return;
+	}
+	nobody = (pw = getpwnam("nobody")) != NULL ? pw->pw_uid : 65534;
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	persist_state_dir = dir;
+	persist_volatile = 0;
+
+	/* doasd answers root */
+	pid = startdoasd(dir);
+	doasdmsg(&m, DOASD_SET, "check-root");
+	if (askdoasd(dir, 0, &m) == -1 || m.op != 0)
+		fail("doasd", "did not store a token for root");
+	doasdmsg(&m, DOASD_USE, "check-root");
+	if (askdoasd(dir, 0, &m) == -1 || m.op != 0 || m.stamp == -1)
+		fail("doasd", "did not keep a token for root");
+
+	/*
+	 * but nobody else, whose requests are not carried out either. The
+	 * socket is only for root to begin with, so let anyone reach it to
+	 * see that doasd asks who is on the other end.
+	 */
+	snprintf(sock, sizeof(sock), "%s/%s", dir, DOASD_SOCKET);
+	if (chmod(dir, 0711) == -1 || chmod(sock, 0666) == -1)
+		err(1, "chmod");
+	doasdmsg(&m, DOASD_USE, "check-root");
+	if (askdoasd(dir, nobody, &m) == 0)
+		fail("doasd", "answered uid %u", nobody);
+	doasdmsg(&m, DOASD_SET, "check-other");
+	if (askdoasd(dir, nobody, &m) == 0)
+		fail("doasd", "answered uid %u", nobody);
+	doasdmsg(&m, DOASD_USE, "check-other");
+	if (askdoasd(dir, 0, &m) == -1 || m.stamp != -1)
+		fail("doasd", "stored a token for uid %u", nobody);
+	doasdmsg(&m, DOASD_DEL, "check-root");
+	if (askdoasd(dir, nobody, &m) == 0)
+		fail("doasd", "answered uid %u", nobody);
+	doasdmsg(&m, DOASD_USE, "check-root");
+	if (askdoasd(dir, 0, &m) == -1 || m.stamp == -1)
+		fail("doasd", "removed a token for uid %u", nobody);
+	if (chmod(dir, 0700) == -1)
+		err(1, "chmod");
+
+	/* tokens are kept by doasd while it runs */
+	withtty(indoasd);
+	stopdoasd(pid);
+
+	/* and in files while it doesn't */
+	if (access(sock, F_OK) == 0)
+		fail("doasd", "left its socket behind");
+	withtty(fallback);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, sock, sizeof(sun.sun_path));
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1 ||
+	    bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "%s", sock);
+	close(fd);
+	withtty(fallbackrefused);
+
+	rmstate(dir);
+}
+#endif
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} checks[] = {
+	{ "match", checkmatch },
+	{ "parse", checkparse },
+	{ "procstat", checkprocstat },
+	{ "prompt", checkprompt },
+#ifdef DOAS_PERSIST_DAEMON
+	{ "doasd", checkdoasd },
+#endif
+};
+
+int
+main(int argc, char **argv)
+{
+	size_t i;
+	int j;
+
+	setprogname("check");
+	for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		for (j = 1; j < argc; j++)
+			if (strcmp(argv[j], checks[i].name) == 0)
+				break;
+		if (argc > 1 && j == argc)
+			continue;
+		failed = skipped = 0;
+		checks[i].fn();
+		if (!skipped || failed)
+			printf("%-8s %s\n", checks[i].name,
+			    failed ? "FAIL" : "ok");
+		if (failed)
+			return 1;
+	}
+	return 0;
+}
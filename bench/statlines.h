@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * /proc/<pid>/stat lines, real and made up, and the fields doas takes
+ * from them: the tty number and the start time, or failure. The command
+ * name in parentheses is the only part a user controls. Checked by
+ * check, and parsed over and over by bench.
+ */
+static const struct {
+	const char *line;
+	int ok;
+	int ttynr;
+	unsigned long long starttime;
+} statlines[] = {
+	{ "13719 (cat) R 13715 13719 13715 0 -1 4194304 84 0 0 0 0 0 0 0 20 "
+	  "0 1 0 319397 2703360 313 18446744073709551615 94881008103424 "
+	  "94881008123305 140727076090960 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0 "
+	  "94881008139312 94881008140928 94881656770560 140727076099392 "
+	  "140727076099412 140727076099412 140727076102123 0\n",
+	  1, 0, 319397 },
+	{ "1021 (bash) S 1020 1021 1021 34816 1410 4194560 9120 86127 0 2 "
+	  "15 6 133 70 20 0 1 0 2418 8962048 1371 18446744073709551615 1 1 "
+	  "0 0 0 0 65536 3686404 1266761467 0 0 0 17 0 0 0 0 0 0 0 0 0 0 0 "
+	  "0 0 0\n", 1, 34816, 2418 },
+	{ "7 (tmux: server) S 1 7 7 0 -1 4194368 0 0 0 0 0 0 0 0 20 0 1 0 "
+	  "99 0 0 0\n", 1, 0, 99 },
+	{ "8 (a) 1 2 3 4 5) S 1 8 8 1025 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 "
+	  "42 0 0 0\n", 1, 1025, 42 },
+	{ "9 ()) S 1 9 9 -5 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 7\n", 1, -5, 7 },
+	{ "10 ((sd-pam)) S 1 10 10 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 55\n",
+	  1, 0, 55 },
+	{ "11 (x) S 1 2 3 4 5 6) S 1 11 11 7 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 "
+	  "66\n", 1, 7, 66 },
+	{ "9 (x) S 1 9 9 2147483647 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 "
+	  "18446744073709551615", 1, 2147483647, 18446744073709551615ULL },
+	{ "9 (x) S 1 9 9 -2147483648 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 1\n",
+	  1, -2147483647 - 1, 1 },
+	{ "9 (x) S 1 9 9 2147483648 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 1\n" },
+	{ "9 (x) S 1 9 9 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 "
+	  "18446744073709551616\n" },
+	{ "9 (x) S 1 9 9 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 12x4\n" },
+	{ "9 (x) S 1 9 9 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0\n" },
+	{ "9 (x) S 1 9 9 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 -3\n" },
+	{ "9 (x) S 1 9 9 +1 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 3\n" },
+	{ "9 (x) S 1 9 9  -1 0 0 0 0 0 0 0 0 0 20 0 1 0 3\n" },
+	{ "9 (1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22\n" },
+	{ "9 x S 1 9 9 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 3\n" },
+	{ "" },
+};
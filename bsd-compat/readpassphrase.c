@@ -28,7 +28,10 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "readpassphrase.h"
@@ -55,8 +58,48 @@ static volatile sig_atomic_t signo[_NSIG];
 
 static void handler(int);
 
+/*
+ * doas: read a character from fd, waiting for it only until deadline
+ * unless that is NULL. The wait is a poll(2) rather than an alarm, so
+ * there is no moment at which the timeout can go unnoticed, and it is
+ * interrupted by the signals caught below just as read(2) is.
+ */
+static ssize_t
+readch(int fd, char *ch, const struct timespec *deadline)
+{
+	struct pollfd pfd;
+	struct timespec now;
+	long long ms;
+	int r;
+
+	if (deadline != NULL) {
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+			return(-1);
+		ms = (long long)(deadline->tv_sec - now.tv_sec) * 1000 +
+		    (deadline->tv_nsec - now.tv_nsec) / 1000000;
+		if (ms < 0)
+			ms = 0;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if ((r = poll(&pfd, 1, ms > INT_MAX ? INT_MAX : ms)) == -1)
+			return(-1);
+		if (r == 0) {
+			errno = ETIMEDOUT;
+			return(-1);
+		}
+	}
+	return(read(fd, ch, 1));
+}
+
 char *
 readpassphrase(const char *prompt, char *buf, size_t bufsiz, int flags)
+{
+	return(readpassphrase_until(prompt, buf, bufsiz, flags, NULL));
+}
+
+char *
+readpassphrase_until(const char *prompt, char *buf, size_t bufsiz, int flags,
+    const struct timespec *deadline)
 {
 	ssize_t nr;
 	int input, output, save_errno, i, need_restart;
@@ -134,7 +177,8 @@ restart:
 		(void)write(output, prompt, strlen(prompt));
 	end = buf + bufsiz - 1;
 	p = buf;
-	while ((nr = read(input, &ch, 1)) == 1 && ch != '\n' && ch != '\r') {
+	while ((nr = readch(input, &ch, deadline)) == 1 && ch != '\n' &&
+	    ch != '\r') {
 		if (p < end) {
 			if ((flags & RPP_SEVENBIT))
 				ch &= 0x7f;
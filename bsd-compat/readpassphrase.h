@@ -39,6 +39,12 @@
 #define RPP_SEVENBIT    0x10		/* Strip the high bit from input. */
 #define RPP_STDIN       0x20		/* Read from stdin, not /dev/tty */
 
+struct timespec;
+
 char * readpassphrase(const char *, char *, size_t, int);
+/* doas: as readpassphrase(), but failing with ETIMEDOUT once the
+   CLOCK_MONOTONIC deadline has passed without a whole line */
+char * readpassphrase_until(const char *, char *, size_t, int,
+    const struct timespec *);
 
 #endif /* !_READPASSPHRASE_H_ */
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compiled configuration cache.
+ *
+ * A compiled cache is a flat, native-endian image of the parsed rule set
+ * which is written next to the configuration file (with ".db" appended to
+ * its name) and mapped read-only in place of running the parser. The image
+ * records the identity of the file it was compiled from, and is ignored
+ * unless that still matches the configuration file exactly, so the
+ * configuration file always remains authoritative.
+ *
+ * Each included file has a compiled cache of its own, which records the
+ * include directives in it rather than the rules they expand to, so a
+ * change to one file only means that one is parsed again.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bsd-compat/compat.h"
+#include "doas.h"
+
+#define CACHE_MAGIC	"DOASDB\0"
+#define CACHE_VERSION	5
+#define CACHE_NONE	UINT32_MAX
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nrules;
+	/* identity of the configuration file this was compiled from */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtimensec;
+	int64_t ctime;
+	int64_t ctimensec;
+	uint32_t uid;
+	uint32_t nlist;		/* number of uint32_t in the list section */
+	uint64_t strsize;	/* number of bytes in the string section */
+};
+
+struct cache_rule {
+	uint32_t lineno;
+	int32_t action;
+	int32_t options;
+	int32_t persist;
+	int32_t prompt;
+	uint32_t ident;		/* offsets into the string section */
+	uint32_t target;
+	uint32_t cmd;
+	uint32_t cmdargs;	/* offsets into the list section */
+	uint32_t envlist;
+};
+
+struct buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/*
+ * The rule strings are interned, so the same pointer always means the
+ * same string, and each is written to the string section only once.
+ */
+struct strent {
+	const char *str;
+	uint32_t off;
+};
+
+struct strmap {
+	struct strent *ent;
+	size_t size;
+	size_t n;
+};
+
+static size_t
+bufadd(struct buf *b, const void *data, size_t len)
+{
+	size_t off = b->len;
+
+	if (b->size - b->len < len) {
+		while (b->size - b->len < len)
+			b->size = b->size ? b->size * 2 : 4096;
+		if ((b->data = realloc(b->data, b->size)) == NULL)
+			err(1, NULL);
+	}
+	memcpy(b->data + off, data, len);
+	b->len += len;
+	return off;
+}
+
+static void
+cachekey(struct cache_header *hdr, const struct stat *sb)
+{
+	hdr->dev = sb->st_dev;
+	hdr->ino = sb->st_ino;
+	hdr->size = sb->st_size;
+	hdr->mtime = sb->st_mtim.tv_sec;
+	hdr->mtimensec = sb->st_mtim.tv_nsec;
+	hdr->ctime = sb->st_ctim.tv_sec;
+	hdr->ctimensec = sb->st_ctim.tv_nsec;
+	hdr->uid = sb->st_uid;
+}
+
+static int
+cachepath(char *path, size_t len, const char *filename)
+{
+	int r;
+
+	r = snprintf(path, len, "%s.db", filename);
+	if (r < 0 || (size_t)r >= len)
+		return -1;
+	return 0;
+}
+
+static const char *
+cachestr(const char *strs, uint64_t strsize, uint32_t off, int *bad)
+{
+	if (off == CACHE_NONE)
+		return NULL;
+	if (off >= strsize) {
+		*bad = 1;
+		return NULL;
+	}
+	return strintern(strs + off, strlen(strs + off), 0);
+}
+
+static const char **
+cachelist(const uint32_t *lists, uint32_t nlist, uint32_t off,
+    const char *strs, uint64_t strsize, const char ***slots, size_t *nslots,
+    int *bad)
+{
+	const char **list;
+	uint32_t i, n;
+
+	if (off == CACHE_NONE)
+		return NULL;
+	if (off >= nlist || (n = lists[off]) > nlist - off - 1 ||
+	    n >= *nslots) {
+		*bad = 1;
+		return NULL;
+	}
+	list = *slots;
+	for (i = 0; i < n; i++) {
+		list[i] = cachestr(strs, strsize, lists[off + 1 + i], bad);
+		if (list[i] == NULL)
+			*bad = 1;
+	}
+	list[n] = NULL;
+	*slots += n + 1;
+	*nslots -= n + 1;
+	return list;
+}
+
+/*
+ * Load the compiled cache for filename, whose stat(2) information is sb.
+ * Returns 0 and adds its rules to the rule set on success, or -1 if there
+ * is no usable cache, in which case the caller should parse filename
+ * instead.
+ */
+int
+cache_load(const char *filename, const struct stat *sb, int checkperms)
+{
+	char path[PATH_MAX];
+	struct cache_header key, hdr;
+	const struct cache_rule *crules;
+	const uint32_t *lists;
+	const char *strs;
+	const char **slots, **slotp;
+	struct rule *r;
+	uint32_t i;
+	struct stat cb;
+	size_t need, nslots;
+	char *map;
+	int fd, bad = 0;
+
+	if (cachepath(path, sizeof(path), filename) == -1)
+		return -1;
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) == -1)
+		return -1;
+	if (fstat(fd, &cb) == -1 || !S_ISREG(cb.st_mode) ||
+	    (size_t)cb.st_size < sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+	/* the cache is trusted exactly as far as the file it replaces */
+	if (checkperms && (cb.st_uid != 0 ||
+	    (cb.st_mode & (S_IWGRP|S_IWOTH)) != 0)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, cb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	memcpy(&hdr, map, sizeof(hdr));
+	memset(&key, 0, sizeof(key));
+	cachekey(&key, sb);
+	if (memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != CACHE_VERSION || hdr.dev != key.dev ||
+	    hdr.ino != key.ino || hdr.size != key.size ||
+	    hdr.mtime != key.mtime || hdr.mtimensec != key.mtimensec ||
+	    hdr.ctime != key.ctime || hdr.ctimensec != key.ctimensec ||
+	    hdr.uid != key.uid)
+		goto stale;
+
+	need = sizeof(hdr) + (size_t)hdr.nrules * sizeof(*crules) +
+	    (size_t)hdr.nlist * sizeof(*lists);
+	if (need > (size_t)cb.st_size ||
+	    hdr.strsize != (size_t)cb.st_size - need ||
+	    (hdr.strsize > 0 && map[cb.st_size - 1] != '\0'))
+		goto stale;
+	crules = (const struct cache_rule *)(map + sizeof(hdr));
+	lists = (const uint32_t *)(crules + hdr.nrules);
+	strs = (const char *)(lists + hdr.nlist);
+
+	/*
+	 * Every list is stored as its length followed by its entries, so
+	 * there is exactly one uint32_t for each entry and its terminator.
+	 */
+	nslots = hdr.nlist;
+	r = reallocarray(NULL, hdr.nrules + 1, sizeof(*r));
+	slots = reallocarray(NULL, nslots + 1, sizeof(*slots));
+	if (!r || !slots)
+		errx(1, "can't allocate rules");
+	slotp = slots;
+	for (i = 0; i < hdr.nrules && !bad; i++) {
+		memset(&r[i], 0, sizeof(r[i]));
+		r[i].lineno = crules[i].lineno;
+		r[i].action = crules[i].action;
+		r[i].options = crules[i].options;
+		r[i].persist = crules[i].persist;
+		r[i].prompt = crules[i].prompt;
+		r[i].ident = cachestr(strs, hdr.strsize, crules[i].ident, &bad);
+		r[i].target = cachestr(strs, hdr.strsize, crules[i].target,
+		    &bad);
+		r[i].cmd = cachestr(strs, hdr.strsize, crules[i].cmd, &bad);
+		r[i].cmdargs = cachelist(lists, hdr.nlist, crules[i].cmdargs,
+		    strs, hdr.strsize, &slotp, &nslots, &bad);
+		r[i].envlist = cachelist(lists, hdr.nlist, crules[i].envlist,
+		    strs, hdr.strsize, &slotp, &nslots, &bad);
+		if (r[i].action == INCLUDE) {
+			if (r[i].cmd == NULL || r[i].cmd[0] != '/')
+				bad = 1;
+		} else if (r[i].ident == NULL || r[i].persist < 0 ||
+		    r[i].prompt < 0 ||
+		    (r[i].action != PERMIT && r[i].action != DENY))
+			bad = 1;
+	}
+	if (bad) {
+		/* not fatal, the configuration file can still be parsed */
+		free(r);
+		free(slots);
+		goto stale;
+	}
+	for (i = 0; i < hdr.nrules; i++)
+		addrule(&r[i]);
+	return 0;
+
+stale:
+	munmap(map, cb.st_size);
+	return -1;
+}
+
+static struct strent *
+strmapfind(struct strmap *m, const char *s)
+{
+	size_t i;
+
+	for (i = ((uintptr_t)s >> 3) * 11400714819323198485ULL & (m->size - 1);
+	    m->ent[i].str != NULL && m->ent[i].str != s;
+	    i = (i + 1) & (m->size - 1))
+		;
+	return &m->ent[i];
+}
+
+static uint32_t
+addstr(struct buf *strs, struct strmap *m, const char *s)
+{
+	struct strent *e, *old;
+	size_t i, oldsize;
+
+	if (s == NULL)
+		return CACHE_NONE;
+	if (m->n >= m->size / 2) {
+		old = m->ent;
+		oldsize = m->size;
+		m->size = oldsize ? oldsize * 2 : 1024;
+		if (!(m->ent = calloc(m->size, sizeof(*m->ent))))
+			err(1, NULL);
+		for (i = 0; i < oldsize; i++)
+			if (old[i].str)
+				*strmapfind(m, old[i].str) = old[i];
+		free(old);
+	}
+	e = strmapfind(m, s);
+	if (e->str == NULL) {
+		if (strs->len >= CACHE_NONE)
+			errx(1, "configuration too large to compile");
+		e->str = s;
+		e->off = bufadd(strs, s, strlen(s) + 1);
+		m->n++;
+	}
+	return e->off;
+}
+
+static uint32_t
+addlist(struct buf *lists, struct buf *strs, struct strmap *m,
+    const char **list)
+{
+	uint32_t off, n, v;
+
+	if (list == NULL)
+		return CACHE_NONE;
+	for (n = 0; list[n]; n++)
+		;
+	off = lists->len / sizeof(uint32_t);
+	bufadd(lists, &n, sizeof(n));
+	for (n = 0; list[n]; n++) {
+		v = addstr(strs, m, list[n]);
+		bufadd(lists, &v, sizeof(v));
+	}
+	return off;
+}
+
+/*
+ * Write the n rules parsed from filename, whose stat(2) information at
+ * the time it was parsed is sb, as its compiled cache.
+ */
+void
+cache_write(const char *filename, const struct stat *sb, struct rule **r,
+    size_t n)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct cache_header hdr;
+	struct cache_rule cr;
+	struct buf crules = { 0 }, lists = { 0 }, strs = { 0 };
+	struct strmap m = { 0 };
+	size_t i;
+	int fd;
+
+	if (cachepath(path, sizeof(path), filename) == -1 ||
+	    cachepath(tmp, sizeof(tmp), path) == -1 ||
+	    strlcat(tmp, ".XXXXXX", sizeof(tmp)) >= sizeof(tmp))
+		errx(1, "%s: path too long", filename);
+
+	for (i = 0; i < n; i++) {
+		memset(&cr, 0, sizeof(cr));
+		cr.lineno = r[i]->lineno;
+		cr.action = r[i]->action;
+		cr.options = r[i]->options;
+		cr.persist = r[i]->persist;
+		cr.prompt = r[i]->prompt;
+		cr.ident = addstr(&strs, &m, r[i]->ident);
+		cr.target = addstr(&strs, &m, r[i]->target);
+		cr.cmd = addstr(&strs, &m, r[i]->cmd);
+		cr.cmdargs = addlist(&lists, &strs, &m, r[i]->cmdargs);
+		cr.envlist = addlist(&lists, &strs, &m, r[i]->envlist);
+		bufadd(&crules, &cr, sizeof(cr));
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.nrules = n;
+	hdr.nlist = lists.len / sizeof(uint32_t);
+	hdr.strsize = strs.len;
+	cachekey(&hdr, sb);
+
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "%s", tmp);
+	if (fchmod(fd, sb->st_mode & (S_IRWXU|S_IRWXG|S_IRWXO)) == -1 ||
+	    write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, crules.data, crules.len) != (ssize_t)crules.len ||
+	    write(fd, lists.data, lists.len) != (ssize_t)lists.len ||
+	    write(fd, strs.data, strs.len) != (ssize_t)strs.len ||
+	    fsync(fd) == -1) {
+		unlink(tmp);
+		err(1, "%s", tmp);
+	}
+	close(fd);
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		err(1, "%s", path);
+	}
+	free(crules.data);
+	free(lists.data);
+	free(strs.data);
+	free(m.ent);
+}
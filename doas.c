@@ -19,6 +19,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 
+#include <dirent.h>
 #include <limits.h>
 #include <string.h>
 #include <stdio.h>
@@ -30,10 +31,14 @@
 #include <syslog.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include "bsd-compat/compat.h"
 #include "shadowauth.h"
 #include "persist.h"
+#include "throttle.h"
 #include "version.h"
 #include "doas.h"
 
@@ -58,153 +63,333 @@
 static void __dead
 usage(void)
 {
-	fprintf(stderr, "usage: doas [-Lns] [-a style] [-C config] [-u user]"
-	    " command [args]\n");
+	fprintf(stderr, "usage: doas [-LRns] [-a style] [-C config [-bw]]"
+	    " [-u user] command [args]\n");
 	exit(1);
 }
 
-static int
-parseuid(const char *s, uid_t *uid)
+#define MAXINCLUDE	8	/* how deeply includes may nest */
+
+static void includeconfig(const char *, int, int, int, int, int);
+
+static void
+checkmode(const char *filename, const struct stat *sb)
 {
-	struct passwd *pw;
-	const char *errstr;
-
-	if ((pw = getpwnam(s)) != NULL) {
-		*uid = pw->pw_uid;
-		if (*uid == UID_MAX)
-			return -1;
-		return 0;
-	}
-	*uid = strtonum(s, 0, UID_MAX - 1, &errstr);
-	if (errstr)
-		return -1;
-	return 0;
+	if ((sb->st_mode & (S_IWGRP|S_IWOTH)) != 0)
+		errx(1, "%s is writable by group or other", filename);
+	if (sb->st_uid != 0)
+		errx(1, "%s is not owned by root", filename);
 }
 
-static int
-uidcheck(const char *s, uid_t desired)
+/*
+ * Add the rules of the configuration file open on fd, from its compiled
+ * cache if that is current, expanding its includes where they appear.
+ */
+static void
+readconfig(const char *filename, int fd, const struct stat *sb,
+    int checkperms, int usecache, int wflag, int depth)
 {
-	uid_t uid;
-
-	if (parseuid(s, &uid) != 0)
-		return -1;
-	if (uid != desired)
-		return -1;
-	return 0;
+	extern void yyinput(int, const char *);
+	extern int yyparse(void);
+	struct rule **own;
+	const char *file = NULL;
+	size_t start, n, i;
+
+	start = nrules;
+	if (!usecache || cache_load(filename, sb, checkperms) == -1) {
+		yyinput(fd, depth ? filename : NULL);
+		yyparse();
+		if (parse_error)
+			exit(1);
+		if (wflag)
+			cache_write(filename, sb, rules + start,
+			    nrules - start);
+	}
+	close(fd);
+
+	n = nrules - start;
+	if (!(own = reallocarray(NULL, n + 1, sizeof(*own))))
+		err(1, NULL);
+	memcpy(own, rules + start, n * sizeof(*own));
+	nrules = start;
+	if (depth)
+		file = strintern(filename, strlen(filename), 1);
+	for (i = 0; i < n; i++) {
+		if (own[i]->action == INCLUDE) {
+			if (depth == MAXINCLUDE)
+				errx(1, "includes nested too deeply at line "
+				    "%lu of %s", own[i]->lineno, filename);
+			includeconfig(own[i]->cmd, 1, checkperms, usecache,
+			    wflag, depth + 1);
+		} else {
+			own[i]->file = file;
+			addrule(own[i]);
+		}
+	}
+	free(own);
 }
 
 static int
-parsegid(const char *s, gid_t *gid)
+namecmp(const void *a, const void *b)
 {
-	struct group *gr;
-	const char *errstr;
-
-	if ((gr = getgrnam(s)) != NULL) {
-		*gid = gr->gr_gid;
-		if (*gid == GID_MAX)
-			return -1;
-		return 0;
-	}
-	*gid = strtonum(s, 0, GID_MAX - 1, &errstr);
-	if (errstr)
-		return -1;
-	return 0;
+	return strcmp(*(char * const *)a, *(char * const *)b);
 }
 
-static int
-match(uid_t uid, gid_t *groups, int ngroups, uid_t target, const char *cmd,
-    const char **cmdargs, struct rule *r)
+/*
+ * Add the rules of every file named *.conf in the directory open on fd,
+ * in lexical order of their names whatever the locale.
+ */
+static void
+readconfigdir(const char *dirname, int fd, int checkperms, int usecache,
+    int wflag, int depth)
 {
-	int i;
-
-	if (r->ident[0] == ':') {
-		gid_t rgid;
-		if (parsegid(r->ident + 1, &rgid) == -1)
-			return 0;
-		for (i = 0; i < ngroups; i++) {
-			if (rgid == groups[i])
-				break;
-		}
-		if (i == ngroups)
-			return 0;
-	} else {
-		if (uidcheck(r->ident, uid) != 0)
-			return 0;
-	}
-	if (r->target && uidcheck(r->target, target) != 0)
-		return 0;
-	if (r->cmd) {
-		if (strcmp(r->cmd, cmd))
-			return 0;
-		if (r->cmdargs) {
-			/* if arguments were given, they should match explicitly */
-			for (i = 0; r->cmdargs[i]; i++) {
-				if (!cmdargs[i])
-					return 0;
-				if (strcmp(r->cmdargs[i], cmdargs[i]))
-					return 0;
-			}
-			if (cmdargs[i])
-				return 0;
+	char path[PATH_MAX], **names = NULL;
+	size_t n = 0, maxnames = 0, i, len;
+	struct dirent *dp;
+	DIR *dir;
+
+	if ((dir = fdopendir(fd)) == NULL)
+		err(1, "%s", dirname);
+	for (errno = 0; (dp = readdir(dir)) != NULL; errno = 0) {
+		len = strlen(dp->d_name);
+		if (dp->d_name[0] == '.' || len < 5 ||
+		    strcmp(dp->d_name + len - 5, ".conf") != 0)
+			continue;
+		if (n == maxnames) {
+			maxnames = maxnames ? maxnames * 2 : 16;
+			if (!(names = reallocarray(names, maxnames,
+			    sizeof(*names))))
+				err(1, NULL);
 		}
+		if ((names[n++] = strdup(dp->d_name)) == NULL)
+			err(1, NULL);
 	}
-	return 1;
+	if (errno)
+		err(1, "%s", dirname);
+	closedir(dir);
+
+	qsort(names, n, sizeof(*names), namecmp);
+	for (i = 0; i < n; i++) {
+		if (snprintf(path, sizeof(path), "%s/%s", dirname,
+		    names[i]) >= (int)sizeof(path))
+			errx(1, "%s/%s: path too long", dirname, names[i]);
+		includeconfig(path, 0, checkperms, usecache, wflag, depth);
+		free(names[i]);
+	}
+	free(names);
 }
 
-static int
-permit(uid_t uid, gid_t *groups, int ngroups, const struct rule **lastr,
-    uid_t target, const char *cmd, const char **cmdargs)
+/* Add the rules of an included file, or directory if dirok is set. */
+static void
+includeconfig(const char *path, int dirok, int checkperms, int usecache,
+    int wflag, int depth)
 {
-	size_t i;
-
-	*lastr = NULL;
-	for (i = 0; i < nrules; i++) {
-		if (match(uid, groups, ngroups, target, cmd,
-		    cmdargs, rules[i]))
-			*lastr = rules[i];
-	}
-	if (!*lastr)
-		return 0;
-	return (*lastr)->action == PERMIT;
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "could not open config file %s", path);
+	if (fstat(fd, &sb) != 0)
+		err(1, "fstat(\"%s\")", path);
+	if (checkperms)
+		checkmode(path, &sb);
+	if (dirok && S_ISDIR(sb.st_mode))
+		readconfigdir(path, fd, checkperms, usecache, wflag, depth);
+	else if (S_ISREG(sb.st_mode))
+		readconfig(path, fd, &sb, checkperms, usecache, wflag, depth);
+	else
+		errx(1, "%s is not a regular file", path);
 }
 
+/*
+ * Load the configuration file and everything it includes. With wflag,
+ * each file parsed is also written out as its compiled cache.
+ */
 static void
-parseconfig(const char *filename, int checkperms)
+parseconfig(const char *filename, int checkperms, int usecache, int wflag)
 {
-	extern FILE *yyfp;
-	extern int yyparse(void);
 	struct stat sb;
+	int fd;
 
-	yyfp = fopen(filename, "r");
-	if (!yyfp)
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
 		err(1, checkperms ? "doas is not enabled, %s" :
 		    "could not open config file %s", filename);
 
-	if (checkperms) {
-		if (fstat(fileno(yyfp), &sb) != 0)
-			err(1, "fstat(\"%s\")", filename);
-		if ((sb.st_mode & (S_IWGRP|S_IWOTH)) != 0)
-			errx(1, "%s is writable by group or other", filename);
-		if (sb.st_uid != 0)
-			errx(1, "%s is not owned by root", filename);
+	if (fstat(fd, &sb) != 0)
+		err(1, "fstat(\"%s\")", filename);
+	if (checkperms)
+		checkmode(filename, &sb);
+
+	readconfig(filename, fd, &sb, checkperms, usecache, wflag, 0);
+	compilerules();
+}
+
+/*
+ * Users and targets named in batch queries, looked up once each.
+ */
+struct qname {
+	char *name;
+	int ok;
+	uid_t uid;
+	gid_t *groups;		/* NULL until needed */
+	int ngroups;
+};
+
+static struct qname **qnames;
+static size_t qnamessize, nqnames;
+
+static struct qname **
+qnamefind(const char *name)
+{
+	const unsigned char *p;
+	size_t h = 5381;
+
+	for (p = (const unsigned char *)name; *p; p++)
+		h = h * 33 + *p;
+	for (h &= qnamessize - 1; qnames[h] && strcmp(qnames[h]->name, name);
+	    h = (h + 1) & (qnamessize - 1))
+		;
+	return &qnames[h];
+}
+
+static struct qname *
+queryname(const char *name, int wantgroups)
+{
+	struct qname **old, **e, *q;
+	struct passwd *pw;
+	size_t i, oldsize;
+	int n;
+
+	if (nqnames >= qnamessize / 2) {
+		old = qnames;
+		oldsize = qnamessize;
+		qnamessize = oldsize ? oldsize * 2 : 256;
+		if (!(qnames = calloc(qnamessize, sizeof(*qnames))))
+			err(1, NULL);
+		for (i = 0; i < oldsize; i++)
+			if (old[i])
+				*qnamefind(old[i]->name) = old[i];
+		free(old);
+	}
+	e = qnamefind(name);
+	if ((q = *e) == NULL) {
+		if (!(q = calloc(1, sizeof(*q))) || !(q->name = strdup(name)))
+			err(1, NULL);
+		q->ok = parseuid(name, &q->uid) == 0;
+		*e = q;
+		nqnames++;
+	}
+	if (wantgroups && q->ok && q->groups == NULL) {
+		n = 0;
+		if ((pw = getpwuid(q->uid)) != NULL &&
+		    getgrouplist(pw->pw_name, pw->pw_gid, NULL, &n) == -1 &&
+		    n > 0) {
+			if (!(q->groups = reallocarray(NULL, n, sizeof(gid_t))))
+				err(1, NULL);
+			if (getgrouplist(pw->pw_name, pw->pw_gid, q->groups,
+			    &n) == -1)
+				n = 0;
+		} else if (!(q->groups = malloc(sizeof(gid_t))))
+			err(1, NULL);
+		q->ngroups = n;
+	}
+	return q;
+}
+
+static void
+printdecision(int permitted, const struct rule *rule)
+{
+	char persist[32] = "", prompt[32] = "";
+
+	if (rule == NULL) {
+		puts("deny");
+		return;
 	}
+	if (rule->persist)
+		snprintf(persist, sizeof(persist), " persist=%d",
+		    rule->persist);
+	else if (rule->options & PERSIST)
+		strlcpy(persist, " persist", sizeof(persist));
+	if (rule->prompt)
+		snprintf(prompt, sizeof(prompt), " prompt=%d", rule->prompt);
+	printf("%s %s%s%lu%s%s%s%s%s%s\n", permitted ? "permit" : "deny",
+	    rule->file ? rule->file : "", rule->file ? ":" : "", rule->lineno,
+	    (rule->options & NOPASS) ? " nopass" : "",
+	    (rule->options & NOLOG) ? " nolog" : "",
+	    persist,
+	    (rule->options & CGROUP) ? " cgroup" : "",
+	    prompt,
+	    (rule->options & KEEPENV) ? " keepenv" : "");
+}
 
-	yyparse();
-	fclose(yyfp);
-	if (parse_error)
-		exit(1);
+/*
+ * Answer queries read from standard input, one per line, against the
+ * loaded configuration. Each query is a tab separated list of user,
+ * target (root if empty), command and any arguments.
+ */
+static void __dead
+checkbatch(void)
+{
+	const struct rule *rule;
+	struct qname *u, *t;
+	char *line = NULL, *p, **fields = NULL;
+	size_t linesize = 0, maxfields = 0, n;
+	ssize_t len;
+	int permitted;
+
+	while ((len = getline(&line, &linesize, stdin)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		n = 0;
+		p = line;
+		do {
+			if (n + 1 >= maxfields) {
+				maxfields = maxfields ? maxfields * 2 : 16;
+				fields = reallocarray(fields, maxfields,
+				    sizeof(*fields));
+				if (!fields)
+					err(1, NULL);
+			}
+			fields[n++] = strsep(&p, "\t");
+		} while (p);
+		fields[n] = NULL;
+
+		if (n < 3 || *fields[2] == '\0') {
+			puts("error malformed query");
+			continue;
+		}
+		u = queryname(fields[0], 1);
+		t = queryname(*fields[1] ? fields[1] : "root", 0);
+		if (!u->ok || !t->ok) {
+			puts("error unknown user");
+			continue;
+		}
+		permitted = permit(u->uid, u->groups, u->ngroups, &rule,
+		    t->uid, fields[2], (const char **)fields + 3);
+		printdecision(permitted, rule);
+	}
+	if (ferror(stdin))
+		err(1, "stdin");
+	if (fflush(stdout) == EOF)
+		err(1, "stdout");
+	exit(0);
 }
 
 static void __dead
-checkconfig(const char *confpath, int argc, char **argv,
-    uid_t uid, gid_t *groups, int ngroups, uid_t target)
+checkconfig(const char *confpath, int bflag, int wflag, int argc,
+    char **argv, uid_t uid, gid_t *groups, int ngroups, uid_t target)
 {
 	const struct rule *rule;
 
 	setresuid(uid, uid, uid);
-	if (pledge("stdio rpath getpw", NULL) == -1)
+	if (pledge(wflag ? "stdio rpath wpath cpath fattr getpw" :
+	    "stdio rpath getpw", NULL) == -1)
 		err(1, "pledge");
-	parseconfig(confpath, 0);
+	/* always parse the file itself when checking or compiling it */
+	parseconfig(confpath, 0, 0, wflag);
+	if (bflag)
+		checkbatch();
 	if (!argc)
 		exit(0);
 
@@ -218,11 +403,32 @@ checkconfig(const char *confpath, int argc, char **argv,
 	}
 }
 
+static void __dead
+throttled(const char *myname, time_t wait)
+{
+	syslog(LOG_AUTHPRIV | LOG_NOTICE,
+	    "too many failed auths for %s", myname);
+	errx(1, "Too many failed authentications, try again in %lld seconds",
+	    (long long)wait);
+}
+
+/*
+ * Ask for the password, giving up after timeout seconds unless it is 0.
+ * The timeout runs from before the budget is checked, so it also covers
+ * waiting for the lock on the throttle count. It is a deadline for the
+ * poll(2) in readpassphrase_until() rather than an alarm, which could go
+ * off before the read it was meant to interrupt had begun.
+ */
 static int
-authuser_checkpass(char *myname, char *login_style)
+authuser_checkpass(char *myname, char *login_style, const char *hash,
+    int timeout)
 {
 	(void) login_style;
 	char *challenge = NULL, *response, rbuf[1024], cbuf[128], host[HOST_NAME_MAX + 1];
+	struct timespec deadline, *until = NULL;
+	time_t wait;
+	long usec;
+	int rv;
 
 	if (gethostname(host, sizeof(host)))
 		snprintf(host, sizeof(host), "?");
@@ -230,14 +436,40 @@ authuser_checkpass(char *myname, char *login_style)
 	    "\rdoas (%.32s@%.32s) password: ", myname, host);
 	challenge = cbuf;
 
-	response = readpassphrase(challenge, rbuf, sizeof(rbuf),
-	    RPP_REQUIRE_TTY);
+	if (timeout > 0) {
+		if (clock_gettime(CLOCK_MONOTONIC, &deadline) == -1)
+			err(1, "clock_gettime");
+		deadline.tv_sec += timeout;
+		until = &deadline;
+	}
+
+	/* don't ask for a password there is no budget to check */
+	if (throttle(0, &wait))
+		throttled(myname, wait);
+
+	response = readpassphrase_until(challenge, rbuf, sizeof(rbuf),
+	    RPP_REQUIRE_TTY, until);
+	if (response == NULL && errno == ETIMEDOUT) {
+		explicit_bzero(rbuf, sizeof(rbuf));
+		syslog(LOG_AUTHPRIV | LOG_NOTICE,
+		    "password prompt timed out for %s", myname);
+		errx(EXIT_TIMEDOUT, "Timed out waiting for a password");
+	}
 	if (response == NULL && errno == ENOTTY) {
 		syslog(LOG_AUTHPRIV | LOG_NOTICE,
 		    "tty required for %s", myname);
 		errx(1, "a tty is required");
 	}
-	if (shadowauth(myname, response) != 0) {
+	if (throttle(1, &wait)) {
+		explicit_bzero(rbuf, sizeof(rbuf));
+		throttled(myname, wait);
+	}
+	rv = shadowauth(hash, response, &usec);
+	if (usec != -1)
+		syslog(LOG_AUTHPRIV | LOG_INFO,
+		    "password check for %s took %ld.%03ld ms", myname,
+		    usec / 1000, usec % 1000);
+	if (rv != 0) {
 		explicit_bzero(rbuf, sizeof(rbuf));
 		syslog(LOG_AUTHPRIV | LOG_NOTICE,
 		    "failed auth for %s", myname);
@@ -245,36 +477,125 @@ authuser_checkpass(char *myname, char *login_style)
 		return AUTH_FAILED;
 	}
 	explicit_bzero(rbuf, sizeof(rbuf));
+	throttle_clear();
 	return AUTH_OK;
 }
 
+/* The longest any rule lets a persisted authentication last. */
+static time_t
+maxpersist(void)
+{
+	time_t max = DOAS_PERSIST_TIMEOUT;
+	size_t i;
+
+	for (i = 0; i < nrules; i++)
+		if (rules[i]->persist > max)
+			max = rules[i]->persist;
+	return max;
+}
+
+/*
+ * The target's passwd entry and supplementary groups. With remote NSS
+ * these can take a while to look up, so it is done while the user types
+ * their password, but nothing is applied until they have authenticated.
+ */
+struct target {
+	uid_t uid;
+	int rv;			/* of getpwuid_r() */
+	struct passwd pwstore, *pw;
+	char pwbuf[_PW_BUF_LEN];
+	gid_t groups[NGROUPS_MAX + 1];
+	int ngroups;		/* -1 if they couldn't be looked up */
+	int started;		/* looked up by thread */
+	pthread_t thread;
+};
+
+static void *
+lookuptarget(void *arg)
+{
+	struct target *t = arg;
+
+	t->ngroups = -1;
+	t->rv = getpwuid_r(t->uid, &t->pwstore, t->pwbuf, sizeof(t->pwbuf),
+	    &t->pw);
+	if (t->rv == 0 && t->pw != NULL) {
+		t->ngroups = NGROUPS_MAX + 1;
+		if (getgrouplist(t->pw->pw_name, t->pw->pw_gid, t->groups,
+		    &t->ngroups) == -1)
+			t->ngroups = -1;
+	}
+	return NULL;
+}
+
+/*
+ * Start looking the target up in a thread of its own, which leaves
+ * every signal to the main thread, as readpassphrase() expects.
+ */
+static void
+prefetchtarget(struct target *t)
+{
+	sigset_t all, old;
+
+	sigfillset(&all);
+	if (pthread_sigmask(SIG_SETMASK, &all, &old) != 0)
+		return;
+	t->started = pthread_create(&t->thread, NULL, lookuptarget, t) == 0;
+	(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Finish looking the target up, or do it now if no thread was started. */
+static void
+gettarget(struct target *t)
+{
+	if (t->started)
+		(void)pthread_join(t->thread, NULL);
+	else
+		lookuptarget(t);
+	t->started = 0;
+}
+
+/*
+ * Authenticate the user, unless they have a persisted authentication no
+ * older than persist seconds, kept for their tty session or their cgroup
+ * as scope says. If persist is 0, none is used or made. Each prompt for
+ * the password gives up after prompt seconds, unless it is 0. The target
+ * is looked up while the user is asked for their password, and their own
+ * password hash only once for every attempt.
+ */
 static void
-authuser(char *myname, char *login_style, int persist)
+authuser(char *myname, char *login_style, int persist, int scope,
+    int prompt, struct target *targ)
 {
 	int i, fd = -1;
-	int rv = PERSIST_ERROR, auth = -1, dir = -1;
-	char name[PATH_MAX], tmp[PATH_MAX];
+	int rv = PERSIST_ERROR;
+	struct persist ps;
+	char *hash;
 
-	if (persist)
+	/* a token kept for the cgroup is used without a tty */
+	if (persist && scope == PERSIST_TTY)
 		fd = open("/dev/tty", O_RDWR);
-	if (fd != -1) {
-		if ((rv = persist_check(&auth, &dir, name,
-		    sizeof(name), tmp, sizeof(tmp))) == PERSIST_OK)
+	if (fd != -1 || (persist && scope == PERSIST_CGROUP)) {
+		if ((rv = persist_check(&ps, persist, scope)) == PERSIST_OK)
 			goto good;
 	}
+	prefetchtarget(targ);
+	hash = shadowlookup(myname);
 	for (i = 0; i < AUTH_RETRIES; i++) {
-		if (authuser_checkpass(myname, login_style) == AUTH_OK)
+		if (authuser_checkpass(myname, login_style, hash,
+		    prompt) == AUTH_OK) {
+			shadowwipe(hash);
 			goto good;
+		}
 	}
+	shadowwipe(hash);
 	exit(1);
 good:
-	if (fd != -1) {
-		if (rv != PERSIST_ERROR)
-			persist_update(auth);
-		if (rv == PERSIST_NEW)
-			persist_commit(dir, tmp, name);
+	if (rv != PERSIST_ERROR)
+		(void)persist_update(&ps);
+	if (rv == PERSIST_NEW)
+		persist_commit(&ps);
+	if (fd != -1)
 		close(fd);
-	}
 }
 
 int
@@ -325,9 +646,10 @@ main(int argc, char **argv)
 	const char *p;
 	const char *cmd;
 	char cmdline[LINE_MAX];
-	char mypwbuf[_PW_BUF_LEN], targpwbuf[_PW_BUF_LEN];
-	struct passwd mypwstore, targpwstore;
+	char mypwbuf[_PW_BUF_LEN];
+	struct passwd mypwstore;
 	struct passwd *mypw, *targpw;
+	static struct target targ;
 	const struct rule *rule;
 	uid_t uid;
 	uid_t target = 0;
@@ -336,6 +658,9 @@ main(int argc, char **argv)
 	int i, ch, rv;
 	int sflag = 0;
 	int nflag = 0;
+	int bflag = 0;
+	int wflag = 0;
+	int Rflag = 0;
 	char cwdpath[PATH_MAX];
 	const char *cwd;
 	char *login_style = NULL;
@@ -347,21 +672,34 @@ main(int argc, char **argv)
 
 	uid = getuid();
 
-	while ((ch = getopt(argc, argv, "+a:C:Lnsu:v")) != -1) {
+	while ((ch = getopt(argc, argv, "+a:bC:LnRsu:vw")) != -1) {
 		switch (ch) {
 		case 'a':
 			login_style = optarg;
 			break;
+		case 'b':
+			bflag = 1;
+			break;
 		case 'C':
 			confpath = optarg;
 			break;
 		case 'L':
+			/*
+			 * The cgroup's token is cleared as well, but only
+			 * decides success when there is no tty to clear for.
+			 */
+			rv = persist_clear(PERSIST_CGROUP);
 			i = open("/dev/tty", O_RDWR);
-			if (i != -1)
-				i = persist_clear();
-			if (i == -1)
+			if (i != -1) {
+				rv = persist_clear(PERSIST_TTY);
+				close(i);
+			}
+			if (rv == -1)
 			        errx(1, "could not clear auth token");
 			exit(0);
+		case 'R':
+			Rflag = 1;
+			break;
 		case 'u':
 			if (parseuid(optarg, &target) != 0)
 				errx(1, "unknown user");
@@ -376,6 +714,9 @@ main(int argc, char **argv)
 		        puts(version);
 			exit(0);
 			break;
+		case 'w':
+			wflag = 1;
+			break;
 		default:
 			usage();
 			break;
@@ -385,9 +726,12 @@ main(int argc, char **argv)
 	argc -= optind;
 
 	if (confpath) {
-		if (sflag)
+		if (sflag || Rflag || (bflag && argc))
+			usage();
+	} else if (Rflag) {
+		if (bflag || wflag || sflag || argc)
 			usage();
-	} else if ((!sflag && !argc) || (sflag && argc))
+	} else if (bflag || wflag || (!sflag && !argc) || (sflag && argc))
 		usage();
 
 	rv = getpwuid_r(uid, &mypwstore, mypwbuf, sizeof(mypwbuf), &mypw);
@@ -413,15 +757,23 @@ main(int argc, char **argv)
 	if (confpath) {
 		if (pledge("stdio rpath getpw id", NULL) == -1)
 			err(1, "pledge");
-		checkconfig(confpath, argc, argv, uid, groups, ngroups,
-		    target);
+		checkconfig(confpath, bflag, wflag, argc, argv, uid, groups,
+		    ngroups, target);
 		exit(1);	/* fail safe */
 	}
 
 	if (geteuid())
 		errx(1, "not installed setuid");
 
-	parseconfig(DOAS_CONF_FILE, 1);
+	parseconfig(DOAS_CONF_FILE, 1, 1, 0);
+
+	if (Rflag) {
+		if (uid != 0)
+			errx(1, "only root may remove stale auth tokens");
+		if (persist_reap(maxpersist()) == -1)
+			errx(1, "could not remove stale auth tokens");
+		exit(0);
+	}
 
 	/* cmdline is used only for logging, no need to abort on truncate */
 	(void)strlcpy(cmdline, argv[0], sizeof(cmdline));
@@ -435,6 +787,7 @@ main(int argc, char **argv)
 	openlog(__progname, LOG_PID, LOG_AUTHPRIV | LOG_NOTICE);
 
 	cmd = argv[0];
+	targ.uid = target;
 	if (!permit(uid, groups, ngroups, &rule, target, cmd,
 	    (const char **)argv + 1)) {
 		syslog(LOG_AUTHPRIV | LOG_NOTICE,
@@ -446,7 +799,11 @@ main(int argc, char **argv)
 		if (nflag)
 			errx(1, "Authentication required");
 
-		authuser(mypw->pw_name, login_style, rule->options & PERSIST);
+		authuser(mypw->pw_name, login_style,
+		    !(rule->options & PERSIST) ? 0 :
+		    rule->persist ? rule->persist : DOAS_PERSIST_TIMEOUT,
+		    (rule->options & CGROUP) ? PERSIST_CGROUP : PERSIST_TTY,
+		    rule->prompt ? rule->prompt : DOAS_PROMPT_TIMEOUT, &targ);
 	}
 
 	if ((p = getenv("PATH")) != NULL)
@@ -470,15 +827,19 @@ main(int argc, char **argv)
 	if (pledge("stdio rpath getpw exec id", NULL) == -1)
 		err(1, "pledge");
 
-	rv = getpwuid_r(target, &targpwstore, targpwbuf, sizeof(targpwbuf), &targpw);
-	if (rv != 0)
+	gettarget(&targ);
+	if (targ.rv != 0) {
+		errno = targ.rv;
 		err(1, "getpwuid_r failed");
-	if (targpw == NULL)
+	}
+	if ((targpw = targ.pw) == NULL)
 		errx(1, "no passwd entry for target");
 
 	/* do the heavy lifting otherwise done by setusercontext() manually */
 	umask(DOAS_DEFAULT_UMASK);
-	if (initgroups(targpw->pw_name, targpw->pw_gid) == -1)
+	if ((targ.ngroups == -1 ?
+	    initgroups(targpw->pw_name, targpw->pw_gid) :
+	    setgroups(targ.ngroups, targ.groups)) == -1)
 	        err(1, "failed to set supplementary groups for '%s'", targpw->pw_name);
 	if (setresgid(targpw->pw_gid, targpw->pw_gid, targpw->pw_gid) == -1)
 	        err(1, "failed to change to gid of '%s'", targpw->pw_name);
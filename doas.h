@@ -16,13 +16,20 @@
  */
 
 struct rule {
+	unsigned long lineno;
 	int action;
 	int options;
+	int persist;		/* persist timeout, 0 for the default */
+	int prompt;		/* prompt timeout, 0 for the default */
 	const char *ident;
 	const char *target;
 	const char *cmd;
 	const char **cmdargs;
 	const char **envlist;
+	const char *file;	/* included file, NULL for the main one */
+	int idflags;
+	id_t identid;		/* resolved uid, or gid for :group */
+	uid_t targetid;		/* resolved target uid */
 };
 
 extern struct rule **rules;
@@ -32,18 +39,43 @@ extern int parse_error;
 extern const char *formerpath;
 
 struct passwd;
+struct stat;
 
 char **prepenv(const struct rule *, const struct passwd *,
     const struct passwd *);
 
+void addrule(struct rule *);
+const char *strintern(const char *, size_t, int);
+const char *strinterned(const char *);
+
+int parseuid(const char *, uid_t *);
+void compilerules(void);
+int permit(uid_t, gid_t *, int, const struct rule **, uid_t, const char *,
+    const char **);
+
+int cache_load(const char *, const struct stat *, int);
+void cache_write(const char *, const struct stat *, struct rule **, size_t);
+
 #define PERMIT	1
 #define DENY	2
+#define INCLUDE	3	/* include directive, path in cmd */
 
 #define NOPASS		0x1
 #define KEEPENV		0x2
 #define PERSIST		0x4
 #define NOLOG		0x8
+#define CGROUP		0x10	/* persist for the cgroup, not the tty */
+
+#define IDENT_GROUP	0x1
+#define IDENT_UNKNOWN	0x2
+#define TARGET_UNKNOWN	0x4
 
 #define AUTH_FAILED	-1
 #define AUTH_OK		0
 #define AUTH_RETRIES	3
+
+#define EXIT_TIMEDOUT	124	/* a password prompt timed out, as timeout(1) */
+
+#ifndef DOAS_PROMPT_TIMEOUT
+#define DOAS_PROMPT_TIMEOUT	0	/* seconds, 0 to wait for ever */
+#endif
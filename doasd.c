@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* doasd keeps the persistent authentication tokens of doas built with the
+   daemon backend in memory, and answers requests about them over a socket
+   in the state directory. Only root, which is to say doas, may ask. It
+   serves one request at a time, each of which is a single packet. */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bsd-compat/compat.h"
+#include "persist.h"
+#include "doasd.h"
+
+#define BUCKETS        4096
+#define SWEEP_INTERVAL 60   /* seconds between removing stale tokens */
+
+struct token {
+    struct token *next;
+    time_t stamp;
+    time_t timeout;         /* of the rule it was last stamped under */
+    char name[sizeof(((struct doasd_msg *)0)->name)];
+};
+
+static struct token *table[BUCKETS];
+static volatile sig_atomic_t quit;
+
+/* FNV-1a */
+static unsigned int hashname(const char *name) {
+    unsigned int h = 2166136261U;
+
+    for (; *name != '\0'; name++)
+        h = (h ^ (unsigned char)*name) * 16777619U;
+
+    return h % BUCKETS;
+}
+
+/* Find the link to the token called name, which is NULL if there is none,
+   and which a new token can then be stored in. */
+static struct token **lookup(const char *name) {
+    struct token **t;
+
+    for (t = &table[hashname(name)]; *t != NULL; t = &(*t)->next)
+        if (strcmp((*t)->name, name) == 0)
+            break;
+
+    return t;
+}
+
+/* Remove every token which has expired or can no longer be used. */
+static void sweep(time_t now) {
+    struct token **t, *dead;
+    size_t i;
+
+    for (i = 0; i < BUCKETS; i++) {
+        t = &table[i];
+        while (*t != NULL) {
+            if (now < (*t)->stamp || (now - (*t)->stamp) > (*t)->timeout ||
+                staletoken((*t)->name, (*t)->stamp, now, (*t)->timeout)) {
+                dead = *t;
+                *t = dead->next;
+                free(dead);
+            } else
+                t = &(*t)->next;
+        }
+    }
+}
+
+/* Answer the request on the connection fd. */
+static void serve(int fd) {
+    struct doasd_msg m;
+    struct token **t, *tok;
+    struct timespec now;
+    struct timeval tv = { DOASD_TIMEOUT, 0 };
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    ssize_t r;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+        cred.uid != 0)
+        return;
+
+    /* A client which never asks must not hold up the others */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+        return;
+
+    do
+        r = recv(fd, &m, sizeof(m), 0);
+    while (r == -1 && errno == EINTR);
+
+    if (r != sizeof(m) || m.name[0] == '\0' ||
+        memchr(m.name, '\0', sizeof(m.name)) == NULL)
+        return;
+
+    /* This is a Linuxism. On Linux, CLOCK_MONOTONIC does not run while
+       the machine is suspended. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        return;
+
+    /* Tokens are only stamped for as long as they are valid for */
+    if (m.op != DOASD_DEL && m.timeout <= 0)
+        return;
+
+    t = lookup(m.name);
+    switch (m.op) {
+    case DOASD_USE:
+        m.stamp = *t != NULL ? (*t)->stamp : -1;
+        m.op = 0;
+        if (m.stamp == -1 || now.tv_sec < m.stamp ||
+            (now.tv_sec - m.stamp) > m.timeout)
+            break;
+        (*t)->stamp = now.tv_sec;
+        (*t)->timeout = m.timeout;
+        break;
+    case DOASD_SET:
+        m.op = -1;
+        if (*t == NULL) {
+            if ((tok = calloc(1, sizeof(*tok))) == NULL)
+                break;
+            strlcpy(tok->name, m.name, sizeof(tok->name));
+            *t = tok;
+        }
+        (*t)->stamp = now.tv_sec;
+        (*t)->timeout = m.timeout;
+        m.op = 0;
+        break;
+    case DOASD_DEL:
+        if (*t != NULL) {
+            tok = *t;
+            *t = tok->next;
+            free(tok);
+        }
+        m.op = 0;
+        break;
+    default:
+        m.op = -1;
+    }
+
+    (void) send(fd, &m, sizeof(m), MSG_NOSIGNAL);
+}
+
+static void onsignal(int sig) {
+    (void) sig;
+    quit = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: doasd [-d directory]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un sun;
+    struct sigaction sa;
+    struct pollfd pfd;
+    struct timespec now;
+    time_t lastsweep = 0;
+    int ch, dirfd, lfd, cfd, r;
+
+    while ((ch = getopt(argc, argv, "d:")) != -1) {
+        switch (ch) {
+        case 'd':
+            persist_state_dir = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    if (geteuid() != 0)
+        errx(1, "must be run as root");
+
+    if ((dirfd = openstatedir(0)) == -1)
+        errx(1, "%s is not a directory only root can use",
+             persist_state_dir);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s",
+                 persist_state_dir, DOASD_SOCKET) >= sizeof(sun.sun_path))
+        errx(1, "%s: path too long", persist_state_dir);
+
+    if ((lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+        err(1, "socket");
+
+    /* A socket nothing is listening on was left behind by a doasd which
+       didn't exit cleanly */
+    if (connect(lfd, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+        errx(1, "already running");
+    if (errno == ECONNREFUSED)
+        (void) unlinkat(dirfd, DOASD_SOCKET, 0);
+    close(lfd);
+
+    if ((lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+        err(1, "socket");
+    umask(077);
+    if (bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+        err(1, "%s", sun.sun_path);
+    if (listen(lfd, SOMAXCONN) == -1)
+        err(1, "listen");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onsignal;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1 ||
+        sigaction(SIGTERM, &sa, NULL) == -1)
+        err(1, "sigaction");
+
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    while (!quit) {
+        r = poll(&pfd, 1, SWEEP_INTERVAL * 1000);
+        if (r == -1 && errno != EINTR)
+            err(1, "poll");
+
+        /* This is a Linuxism. See above. */
+        if (clock_gettime(CLOCK_BOOTTIME, &now) == 0 &&
+            now.tv_sec - lastsweep >= SWEEP_INTERVAL) {
+            sweep(now.tv_sec);
+            lastsweep = now.tv_sec;
+        }
+
+        if (r <= 0)
+            continue;
+        if ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+            continue;
+        serve(cfd);
+        close(cfd);
+    }
+
+    (void) unlinkat(dirfd, DOASD_SOCKET, 0);
+    return 0;
+}
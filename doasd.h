@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _DOASD_H
+#define _DOASD_H
+
+#include <stdint.h>
+
+/* The socket doasd listens on, in the state directory */
+#define DOASD_SOCKET "doasd.sock"
+
+/* How long either side waits for the other, in seconds */
+#define DOASD_TIMEOUT 1
+
+/* Requests, one per connection */
+#define DOASD_USE 1     /* check the token, and stamp it again if valid */
+#define DOASD_SET 2     /* stamp the token now, after authenticating */
+#define DOASD_DEL 3     /* remove the token */
+
+/* A request, and its answer, which has op set to 0 on success or -1 on
+   failure. Both are sent as a single packet. A valid token is stamped
+   again by the request which checks it, so using one takes only a
+   single request. Stamping one costs no write, so every use is recorded,
+   whatever PERSIST_REFRESH is, and its timeout runs from its last use. */
+struct doasd_msg {
+    int32_t op;
+    int32_t timeout;        /* how long the token is valid for */
+    int32_t pad;
+    int64_t stamp;          /* answer to USE: the stamp it had, or -1 */
+    char name[112];         /* token name, from gettokenname() */
+};
+
+#endif /* _DOASD_H */
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2015 Ted Unangst <tedu@openbsd.org>
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include "bsd-compat/compat.h"
+#include "doas.h"
+
+/*
+ * The rules are compiled into a decision tree, which branches on the
+ * identity, the target, the command and then its arguments. Each node
+ * has keyed edges for particular values, kept in a single hash table,
+ * and one edge for rules which don't restrict the next level. Each leaf
+ * holds the last rule which reaches it, so permit() only has to compare
+ * a handful of leaves, however many rules there are.
+ */
+enum {
+	E_USER,
+	E_GROUP,
+	E_TARGET,
+	E_CMD,
+	E_ARGS,
+};
+
+struct edge {
+	uint32_t from;
+	uint32_t to;		/* 0 for unused entries */
+	uintptr_t key;		/* uid, gid or interned command */
+	const char **args;	/* interned arguments for E_ARGS */
+	int kind;
+};
+
+struct node {
+	ssize_t last;		/* last rule ending here, or -1 */
+	uint32_t any;		/* child for rules not restricting this level */
+	uint32_t nkeyed;	/* number of keyed edges from here */
+};
+
+#define NONODE	0		/* node 0 is a dead end */
+#define ROOT	1
+
+static struct edge *edges;
+static size_t edgessize, nedges;
+static struct node *nodes;
+static uint32_t nnodes;
+
+/*
+ * Users and groups named in the rules are looked up once each, however
+ * many rules name them.
+ */
+struct resolved {
+	const char *name;	/* NULL for unused entries */
+	int group;
+	int ok;
+	id_t id;
+};
+
+static struct resolved *names;
+static size_t namessize;
+
+int
+parseuid(const char *s, uid_t *uid)
+{
+	struct passwd *pw;
+	const char *errstr;
+
+	if ((pw = getpwnam(s)) != NULL) {
+		*uid = pw->pw_uid;
+		if (*uid == UID_MAX)
+			return -1;
+		return 0;
+	}
+	*uid = strtonum(s, 0, UID_MAX - 1, &errstr);
+	if (errstr)
+		return -1;
+	return 0;
+}
+
+static int
+parsegid(const char *s, gid_t *gid)
+{
+	struct group *gr;
+	const char *errstr;
+
+	if ((gr = getgrnam(s)) != NULL) {
+		*gid = gr->gr_gid;
+		if (*gid == GID_MAX)
+			return -1;
+		return 0;
+	}
+	*gid = strtonum(s, 0, GID_MAX - 1, &errstr);
+	if (errstr)
+		return -1;
+	return 0;
+}
+
+static uint64_t
+hashstr(uint64_t h, const char *s)
+{
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+	return h;
+}
+
+static size_t
+edgehash(uint32_t from, int kind, uintptr_t key, const char **args)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	h = (h ^ from) * 1099511628211ULL;
+	h = (h ^ (uint64_t)kind) * 1099511628211ULL;
+	h = (h ^ (uint64_t)key) * 1099511628211ULL;
+	for (; args && *args; args++)
+		h = (h ^ (uintptr_t)*args) * 1099511628211ULL;
+	return h ^ (h >> 32);
+}
+
+static int
+argseq(const char **a, const char **b)
+{
+	/* strings are interned, so pointers can be compared */
+	for (; *a && *b; a++, b++)
+		if (*a != *b)
+			return 0;
+	return *a == *b;
+}
+
+static struct edge *
+edgefind(uint32_t from, int kind, uintptr_t key, const char **args)
+{
+	struct edge *e;
+	size_t i;
+
+	for (i = edgehash(from, kind, key, args) & (edgessize - 1); ;
+	    i = (i + 1) & (edgessize - 1)) {
+		e = &edges[i];
+		if (e->to == 0)
+			return e;
+		if (e->from == from && e->kind == kind && e->key == key &&
+		    (kind != E_ARGS || argseq(e->args, args)))
+			return e;
+	}
+}
+
+/* Follow a keyed edge, returning the node it leads to or NONODE. */
+static uint32_t
+walk(uint32_t from, int kind, uintptr_t key, const char **args)
+{
+	if (nodes[from].nkeyed == 0)
+		return NONODE;
+	return edgefind(from, kind, key, args)->to;
+}
+
+static uint32_t
+addnode(void)
+{
+	nodes[nnodes].last = -1;
+	nodes[nnodes].any = NONODE;
+	nodes[nnodes].nkeyed = 0;
+	return nnodes++;
+}
+
+static uint32_t
+addedge(uint32_t from, int kind, uintptr_t key, const char **args)
+{
+	struct edge *e, *old;
+	size_t i, oldsize;
+
+	if (nedges >= edgessize / 2) {
+		old = edges;
+		oldsize = edgessize;
+		edgessize = oldsize ? oldsize * 2 : 1024;
+		if (!(edges = calloc(edgessize, sizeof(*edges))))
+			errx(1, "can't allocate rule tree");
+		for (i = 0; i < oldsize; i++)
+			if (old[i].to)
+				*edgefind(old[i].from, old[i].kind, old[i].key,
+				    old[i].args) = old[i];
+		free(old);
+	}
+
+	e = edgefind(from, kind, key, args);
+	if (e->to == 0) {
+		e->from = from;
+		e->kind = kind;
+		e->key = key;
+		e->args = args;
+		e->to = addnode();
+		nodes[from].nkeyed++;
+		nedges++;
+	}
+	return e->to;
+}
+
+static uint32_t
+addany(uint32_t from)
+{
+	if (nodes[from].any == NONODE)
+		nodes[from].any = addnode();
+	return nodes[from].any;
+}
+
+/* Resolve a user name, or a group name if group is set, to its id. */
+static int
+resolve(const char *name, int group, id_t *id)
+{
+	struct resolved *n;
+	size_t i;
+	uid_t uid;
+	gid_t gid;
+
+	for (i = hashstr(14695981039346656037ULL + group, name) &
+	    (namessize - 1); ; i = (i + 1) & (namessize - 1)) {
+		n = &names[i];
+		if (n->name == NULL)
+			break;
+		if (n->group == group && strcmp(n->name, name) == 0) {
+			*id = n->id;
+			return n->ok ? 0 : -1;
+		}
+	}
+	n->name = name;
+	n->group = group;
+	if (group) {
+		n->ok = parsegid(name, &gid) == 0;
+		n->id = gid;
+	} else {
+		n->ok = parseuid(name, &uid) == 0;
+		n->id = uid;
+	}
+	*id = n->id;
+	return n->ok ? 0 : -1;
+}
+
+static void
+resolverules(void)
+{
+	struct rule *r;
+	size_t i;
+	id_t id;
+
+	/* every rule names at most two, keep the table at most half full */
+	free(names);
+	for (namessize = 16; namessize < nrules * 4; namessize *= 2)
+		;
+	if (!(names = calloc(namessize, sizeof(*names))))
+		errx(1, "can't allocate rule index");
+
+	for (i = 0; i < nrules; i++) {
+		r = rules[i];
+		r->idflags = 0;
+		if (r->ident[0] == ':') {
+			r->idflags |= IDENT_GROUP;
+			if (resolve(r->ident + 1, 1, &r->identid) == -1)
+				r->idflags |= IDENT_UNKNOWN;
+		} else {
+			if (resolve(r->ident, 0, &r->identid) == -1)
+				r->idflags |= IDENT_UNKNOWN;
+		}
+		if (r->target) {
+			if (resolve(r->target, 0, &id) == -1)
+				r->idflags |= TARGET_UNKNOWN;
+			r->targetid = id;
+		}
+	}
+}
+
+void
+compilerules(void)
+{
+	struct rule *r;
+	uint32_t n;
+	size_t i;
+
+	resolverules();
+
+	/* each rule adds at most four nodes to the dead end and root */
+	if (nrules >= (UINT32_MAX - 2) / 4)
+		errx(1, "too many rules");
+	free(edges);
+	free(nodes);
+	edges = NULL;
+	edgessize = nedges = 0;
+	if (!(nodes = reallocarray(NULL, nrules * 4 + 2, sizeof(*nodes))))
+		errx(1, "can't allocate rule tree");
+	nnodes = 0;
+	addnode();	/* NONODE */
+	addnode();	/* ROOT */
+
+	for (i = 0; i < nrules; i++) {
+		r = rules[i];
+		if (r->idflags & (IDENT_UNKNOWN|TARGET_UNKNOWN))
+			continue;	/* never matches */
+		n = addedge(ROOT, (r->idflags & IDENT_GROUP) ? E_GROUP : E_USER,
+		    r->identid, NULL);
+		n = r->target ? addedge(n, E_TARGET, r->targetid, NULL) :
+		    addany(n);
+		n = r->cmd ? addedge(n, E_CMD, (uintptr_t)r->cmd, NULL) :
+		    addany(n);
+		n = r->cmdargs ? addedge(n, E_ARGS, 0, r->cmdargs) :
+		    addany(n);
+		/* later rules take precedence */
+		nodes[n].last = i;
+	}
+}
+
+static void
+matchleaf(uint32_t n, ssize_t *last)
+{
+	if (nodes[n].last > *last)
+		*last = nodes[n].last;
+}
+
+static void
+matchident(uint32_t n, uid_t target, const char *cmd, const char **cmdargs,
+    ssize_t *last)
+{
+	uint32_t t[2], c;
+	int i;
+
+	t[0] = walk(n, E_TARGET, target, NULL);
+	t[1] = nodes[n].any;
+	for (i = 0; i < 2; i++) {
+		if (cmd) {
+			c = walk(t[i], E_CMD, (uintptr_t)cmd, NULL);
+			if (cmdargs)
+				matchleaf(walk(c, E_ARGS, 0, cmdargs), last);
+			matchleaf(nodes[c].any, last);
+		}
+		matchleaf(nodes[nodes[t[i]].any].any, last);
+	}
+}
+
+int
+permit(uid_t uid, gid_t *groups, int ngroups, const struct rule **lastr,
+    uid_t target, const char *cmd, const char **cmdargs)
+{
+	const char **iargs = NULL;
+	ssize_t last = -1;
+	size_t n;
+	int i;
+
+	*lastr = NULL;
+	if (nodes == NULL)
+		return 0;
+
+	/*
+	 * No rule names a command or argument which was never interned.
+	 * Otherwise use the interned copies, which the tree is keyed on.
+	 */
+	if ((cmd = strinterned(cmd)) != NULL) {
+		for (n = 0; cmdargs[n]; n++)
+			;
+		if (!(iargs = reallocarray(NULL, n + 1, sizeof(*iargs))))
+			err(1, NULL);
+		for (n = 0; cmdargs[n]; n++) {
+			if ((iargs[n] = strinterned(cmdargs[n])) == NULL) {
+				free(iargs);
+				iargs = NULL;
+				break;
+			}
+		}
+		if (iargs)
+			iargs[n] = NULL;
+	}
+
+	matchident(walk(ROOT, E_USER, uid, NULL), target, cmd, iargs, &last);
+	for (i = 0; i < ngroups; i++)
+		matchident(walk(ROOT, E_GROUP, groups[i], NULL), target, cmd,
+		    iargs, &last);
+	free(iargs);
+
+	if (last == -1)
+		return 0;
+	*lastr = rules[last];
+	return (*lastr)->action == PERMIT;
+}
@@ -17,8 +17,11 @@
 
 %{
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdarg.h>
@@ -35,11 +38,17 @@ typedef struct {
 		struct {
 			int action;
 			int options;
+			int persist;
+			int prompt;
 			const char *cmd;
 			const char **cmdargs;
 			const char **envlist;
 		};
-		const char **strlist;
+		struct {
+			const char **strlist;
+			size_t nstrlist;
+			size_t maxstrlist;
+		};
 		const char *str;
 	};
 	unsigned long lineno;
@@ -47,7 +56,16 @@ typedef struct {
 } yystype;
 #define YYSTYPE yystype
 
-FILE *yyfp;
+/* the whole configuration file is read into memory and lexed from there */
+static char *yybuf;
+static size_t yylen, yypos;
+static int yyreaderr;
+static const char *yyfile;	/* included file being read, for errors */
+static int optpos;		/* between permit or deny and the identity */
+static int inbraces;		/* inside the braces of setenv */
+
+#define lgetc()		(yypos < yylen ? (unsigned char)yybuf[yypos++] : EOF)
+#define lungetc()	(yypos--)
 
 struct rule **rules;
 size_t nrules;
@@ -58,22 +76,176 @@ int parse_error = 0;
 static void yyerror(const char *, ...);
 static int yylex(void);
 
-static size_t
-arraylen(const char **arr)
+/*
+ * Rules, strings and string lists live in an arena for the lifetime of
+ * the process, which saves the many small allocations a large
+ * configuration would otherwise need. Memory from the arena is zeroed.
+ */
+#define ARENA_CHUNK	65536
+
+struct chunk {
+	struct chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+static struct chunk *arena;
+
+static void *
+palloc(size_t size)
+{
+	struct chunk *c;
+	void *p;
+
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	if (!arena || arena->size - arena->used < size) {
+		c = calloc(1, sizeof(*c) +
+		    (size > ARENA_CHUNK ? size : ARENA_CHUNK));
+		if (!c)
+			errx(1, "can't allocate rules");
+		c->size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		c->next = arena;
+		arena = c;
+	}
+	p = (char *)arena->data + arena->used;
+	arena->used += size;
+	return p;
+}
+
+/*
+ * Every string in the rules is interned, so identical names, commands
+ * and arguments share storage and can be compared by pointer.
+ */
+struct istr {
+	const char *str;
+	size_t len;
+	uint64_t hash;
+};
+
+static struct istr *strtab;
+static size_t strtabsize, nstrtab;
+
+static uint64_t
+strhash(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+	return h;
+}
+
+static struct istr *
+strfind(const char *s, size_t len, uint64_t h)
 {
-	size_t cnt = 0;
+	struct istr *e;
+	size_t i;
 
-	while (*arr) {
-		cnt++;
-		arr++;
+	for (i = h & (strtabsize - 1); ; i = (i + 1) & (strtabsize - 1)) {
+		e = &strtab[i];
+		if (e->str == NULL || (e->hash == h && e->len == len &&
+		    memcmp(e->str, s, len) == 0))
+			return e;
 	}
-	return cnt;
+}
+
+/*
+ * Return the interned copy of the len bytes at s, adding it if it is not
+ * there yet. If copy is not set, s must be NUL terminated and outlive
+ * the table, and is added as it is.
+ */
+const char *
+strintern(const char *s, size_t len, int copy)
+{
+	struct istr *old, *e;
+	uint64_t h;
+	size_t i, oldsize;
+	char *p;
+
+	if (nstrtab >= strtabsize / 2) {
+		old = strtab;
+		oldsize = strtabsize;
+		strtabsize = oldsize ? oldsize * 2 : 1024;
+		if (!(strtab = calloc(strtabsize, sizeof(*strtab))))
+			errx(1, "can't allocate strings");
+		for (i = 0; i < oldsize; i++)
+			if (old[i].str)
+				*strfind(old[i].str, old[i].len,
+				    old[i].hash) = old[i];
+		free(old);
+	}
+
+	h = strhash(s, len);
+	e = strfind(s, len, h);
+	if (e->str)
+		return e->str;
+	if (copy) {
+		p = palloc(len + 1);
+		memcpy(p, s, len);
+		s = p;
+	}
+	e->str = s;
+	e->len = len;
+	e->hash = h;
+	nstrtab++;
+	return s;
+}
+
+/* Return the interned copy of s, or NULL if no rule uses it. */
+const char *
+strinterned(const char *s)
+{
+	struct istr *e;
+	size_t len;
+
+	if (strtabsize == 0)
+		return NULL;
+	len = strlen(s);
+	e = strfind(s, len, strhash(s, len));
+	return e->str;
+}
+
+/* Append a rule to the rule set. */
+void
+addrule(struct rule *r)
+{
+	if (nrules == maxrules) {
+		if (maxrules == 0)
+			maxrules = 32;
+		rules = reallocarray(rules, maxrules, 2 * sizeof(*rules));
+		if (!rules)
+			errx(1, "can't allocate rules");
+		maxrules *= 2;
+	}
+	rules[nrules++] = r;
+}
+
+/* Free all parsed rules and the strings they use, ready to parse again. */
+void
+freerules(void)
+{
+	struct chunk *c;
+
+	while ((c = arena) != NULL) {
+		arena = c->next;
+		free(c);
+	}
+	free(strtab);
+	strtab = NULL;
+	strtabsize = nstrtab = 0;
+	free(rules);
+	rules = NULL;
+	nrules = maxrules = 0;
+	parse_error = 0;
 }
 
 %}
 
 %token TPERMIT TDENY TAS TCMD TARGS
-%token TNOPASS TNOLOG TPERSIST TKEEPENV TSETENV
+%token TNOPASS TNOLOG TPERSIST TPERSISTTIME TPROMPTTIME TCGROUP TKEEPENV
+%token TSETENV
+%token TINCLUDE
 %token TSTRING
 
 %%
@@ -81,54 +253,94 @@ arraylen(const char **arr)
 grammar:	/* empty */
 		| grammar '\n'
 		| grammar rule '\n'
+		| grammar include '\n'
 		| error '\n'
 		;
 
 rule:		action ident target cmd {
 			struct rule *r;
 
-			r = calloc(1, sizeof(*r));
-			if (!r)
-				errx(1, "can't allocate rule");
+			r = palloc(sizeof(*r));
+			r->lineno = $1.lineno + 1;
 			r->action = $1.action;
 			r->options = $1.options;
+			r->persist = $1.persist;
+			r->prompt = $1.prompt;
 			r->envlist = $1.envlist;
 			r->ident = $2.str;
 			r->target = $3.str;
 			r->cmd = $4.cmd;
 			r->cmdargs = $4.cmdargs;
-			if (nrules == maxrules) {
-				if (maxrules == 0)
-					maxrules = 32;
-				rules = reallocarray(rules, maxrules,
-				    2 * sizeof(*rules));
-				if (!rules)
-					errx(1, "can't allocate rules");
-				maxrules *= 2;
+			addrule(r);
+		} ;
+
+include:	TINCLUDE TSTRING {
+			struct rule *r;
+
+			/* expanded in place by the caller once parsed */
+			if ($2.str[0] != '/') {
+				yyerror("include path must be absolute");
+				YYERROR;
 			}
-			rules[nrules++] = r;
+			r = palloc(sizeof(*r));
+			r->lineno = $1.lineno + 1;
+			r->action = INCLUDE;
+			r->cmd = $2.str;
+			addrule(r);
 		} ;
 
 action:		TPERMIT options {
+			if (($2.options & (CGROUP|PERSIST)) == CGROUP) {
+				yyerror("cgroup requires persist");
+				YYERROR;
+			}
+			$$.lineno = $1.lineno;
 			$$.action = PERMIT;
 			$$.options = $2.options;
+			$$.persist = $2.persist;
+			$$.prompt = $2.prompt;
 			$$.envlist = $2.envlist;
 		} | TDENY {
+			$$.lineno = $1.lineno;
 			$$.action = DENY;
 			$$.options = 0;
+			$$.persist = 0;
+			$$.prompt = 0;
 			$$.envlist = NULL;
 		} ;
 
 options:	/* none */ {
 			$$.options = 0;
+			$$.persist = 0;
+			$$.prompt = 0;
 			$$.envlist = NULL;
 		} | options option {
 			$$.options = $1.options | $2.options;
+			$$.persist = $1.persist;
+			$$.prompt = $1.prompt;
 			$$.envlist = $1.envlist;
 			if (($$.options & (NOPASS|PERSIST)) == (NOPASS|PERSIST)) {
 				yyerror("can't combine nopass and persist");
 				YYERROR;
 			}
+			if ($2.persist) {
+				if ($$.persist) {
+					yyerror("can't have two persist timeouts");
+					YYERROR;
+				} else
+					$$.persist = $2.persist;
+			}
+			if ($2.prompt) {
+				if ($$.prompt) {
+					yyerror("can't have two prompt timeouts");
+					YYERROR;
+				} else
+					$$.prompt = $2.prompt;
+			}
+			if (($$.options & NOPASS) && $$.prompt) {
+				yyerror("can't combine nopass and prompt");
+				YYERROR;
+			}
 			if ($2.envlist) {
 				if ($$.envlist) {
 					yyerror("can't have two setenv sections");
@@ -139,32 +351,77 @@ options:	/* none */ {
 		} ;
 option:		TNOPASS {
 			$$.options = NOPASS;
+			$$.persist = 0;
+			$$.prompt = 0;
 			$$.envlist = NULL;
 		} | TNOLOG {
 			$$.options = NOLOG;
+			$$.persist = 0;
+			$$.prompt = 0;
 			$$.envlist = NULL;
 		} | TPERSIST {
 			$$.options = PERSIST;
+			$$.persist = 0;
+			$$.prompt = 0;
+			$$.envlist = NULL;
+		} | TPERSISTTIME {
+			const char *errstr;
+
+			$$.options = PERSIST;
+			$$.persist = strtonum($1.str, 1, INT_MAX, &errstr);
+			if (errstr) {
+				yyerror("persist timeout %s is %s", $1.str,
+				    errstr);
+				YYERROR;
+			}
+			$$.prompt = 0;
+			$$.envlist = NULL;
+		} | TPROMPTTIME {
+			const char *errstr;
+
+			$$.options = 0;
+			$$.persist = 0;
+			$$.prompt = strtonum($1.str, 1, INT_MAX, &errstr);
+			if (errstr) {
+				yyerror("prompt timeout %s is %s", $1.str,
+				    errstr);
+				YYERROR;
+			}
+			$$.envlist = NULL;
+		} | TCGROUP {
+			$$.options = CGROUP;
+			$$.persist = 0;
+			$$.prompt = 0;
 			$$.envlist = NULL;
 		} | TKEEPENV {
 			$$.options = KEEPENV;
+			$$.persist = 0;
+			$$.prompt = 0;
 			$$.envlist = NULL;
 		} | TSETENV '{' strlist '}' {
 			$$.options = 0;
+			$$.persist = 0;
+			$$.prompt = 0;
 			$$.envlist = $3.strlist;
 		} ;
 
 strlist:	/* empty */ {
-			if (!($$.strlist = calloc(1, sizeof(char *))))
-				errx(1, "can't allocate strlist");
+			$$.nstrlist = 0;
+			$$.maxstrlist = 4;
+			$$.strlist = palloc($$.maxstrlist * sizeof(char *));
 		} | strlist TSTRING {
-			int nstr = arraylen($1.strlist);
-
-			if (!($$.strlist = reallocarray($1.strlist, nstr + 2,
-			    sizeof(char *))))
-				errx(1, "can't allocate strlist");
-			$$.strlist[nstr] = $2.str;
-			$$.strlist[nstr + 1] = NULL;
+			$$.strlist = $1.strlist;
+			$$.nstrlist = $1.nstrlist;
+			$$.maxstrlist = $1.maxstrlist;
+			/* the old list is left behind, doubling bounds the waste */
+			if ($$.nstrlist + 1 == $$.maxstrlist) {
+				$$.maxstrlist *= 2;
+				$$.strlist = palloc($$.maxstrlist * sizeof(char *));
+				memcpy($$.strlist, $1.strlist,
+				    $$.nstrlist * sizeof(char *));
+			}
+			$$.strlist[$$.nstrlist++] = $2.str;
+			$$.strlist[$$.nstrlist] = NULL;
 		} ;
 
 
@@ -203,7 +460,10 @@ yyerror(const char *fmt, ...)
 	va_start(va, fmt);
 	vfprintf(stderr, fmt, va);
 	va_end(va);
-	fprintf(stderr, " at line %lu\n", yylval.lineno + 1);
+	fprintf(stderr, " at line %lu", yylval.lineno + 1);
+	if (yyfile)
+		fprintf(stderr, " of %s", yyfile);
+	fprintf(stderr, "\n");
 	parse_error = 1;
 }
 
@@ -219,24 +479,152 @@ static struct keyword {
 	{ "nopass", TNOPASS },
 	{ "nolog", TNOLOG },
 	{ "persist", TPERSIST },
+	{ "cgroup", TCGROUP },
 	{ "keepenv", TKEEPENV },
 	{ "setenv", TSETENV },
+	{ "include", TINCLUDE },
+};
+
+/*
+ * Perfect hash of the keywords above: the first two characters and the
+ * length are enough to tell them all apart. If a new keyword collides,
+ * pick another multiplier or table size.
+ */
+#define KWHASH(s, len) \
+	(((unsigned char)(s)[0] + (unsigned char)(s)[1] * 11 + (len)) & 31)
+
+static const struct keyword *kwtable[32];
+
+static const struct keyword *
+kwlookup(const char *s, size_t len)
+{
+	static int init;
+	const struct keyword *kw;
+	size_t i;
+
+	if (!init) {
+		for (i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+			kw = &keywords[i];
+			if (kwtable[KWHASH(kw->word, strlen(kw->word))])
+				errx(1, "keyword hash collision for %s",
+				    kw->word);
+			kwtable[KWHASH(kw->word, strlen(kw->word))] = kw;
+		}
+		init = 1;
+	}
+	if (len < 2)
+		return NULL;
+	kw = kwtable[KWHASH(s, len)];
+	if (kw && strncmp(kw->word, s, len) == 0 && kw->word[len] == '\0')
+		return kw;
+	return NULL;
+}
+
+/*
+ * "persist=" or "prompt=" and a timeout are one word, which is lexed as a
+ * token of its own with the timeout as its string, to be checked by the
+ * parser. Only words among the options of a rule, whose value is all
+ * digits, are taken as timeouts; anywhere else, such as in the arguments
+ * of a command, they are strings like any other. Returns the token, or 0
+ * if the word is not a timeout.
+ */
+static int
+timeoutword(const char *s, size_t len)
+{
+	size_t n, i;
+	int token;
+
+	if (!optpos || inbraces)
+		return 0;
+	if (len > 8 && strncmp(s, "persist=", 8) == 0) {
+		n = 8;
+		token = TPERSISTTIME;
+	} else if (len > 7 && strncmp(s, "prompt=", 7) == 0) {
+		n = 7;
+		token = TPROMPTTIME;
+	} else
+		return 0;
+	for (i = n; i < len; i++)
+		if (s[i] < '0' || s[i] > '9')
+			return 0;
+	yylval.str = strintern(s + n, len - n, 1);
+	return token;
+}
+
+/* Note whether the word about to be returned leaves the rule's options. */
+static int
+lexword(int token)
+{
+	if (token == TPERMIT || token == TDENY)
+		optpos = 1;
+	else if (token == TSTRING && !inbraces)
+		optpos = 0;
+	return token;
+}
+
+/* characters which end a word or need the slow path in yylex() */
+static const char special[256] = {
+	['\0'] = 1, ['\\'] = 1, ['"'] = 1,
+	['\n'] = 1, ['{'] = 1, ['}'] = 1, ['#'] = 1, [' '] = 1, ['\t'] = 1,
 };
 
+/*
+ * Read the configuration file open on fd into memory for yylex(). A read
+ * error is reported by the lexer once it reaches the end of what could
+ * be read. filename is given for included files, to name them in errors.
+ */
+void
+yyinput(int fd, const char *filename)
+{
+	struct stat sb;
+	size_t size = 4096;
+	ssize_t r;
+
+	free(yybuf);
+	yylen = yypos = 0;
+	yyreaderr = 0;
+	optpos = inbraces = 0;
+	yyfile = filename;
+	yylval.lineno = yylval.colno = 0;
+
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0)
+		size = sb.st_size + 1;
+	if ((yybuf = malloc(size)) == NULL)
+		err(1, "%s", __func__);
+	for (;;) {
+		if (yylen == size) {
+			if ((yybuf = reallocarray(yybuf, size, 2)) == NULL)
+				err(1, "%s", __func__);
+			size *= 2;
+		}
+		r = read(fd, yybuf + yylen, size - yylen);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			yyreaderr = 1;
+			break;
+		}
+		if (r == 0)
+			break;
+		yylen += r;
+	}
+}
+
 int
 yylex(void)
 {
-	char buf[1024], *ebuf, *p, *str;
-	int c, quoted = 0, quotes = 0, qerr = 0, escape = 0, nonkw = 0;
+	char buf[1024], *ebuf, *p;
+	int c, tok, quoted = 0, quotes = 0, qerr = 0, escape = 0, nonkw = 0;
 	unsigned long qpos = 0;
-	size_t i;
+	const struct keyword *kw;
+	size_t start, end;
 
 	p = buf;
 	ebuf = buf + sizeof(buf);
 
 repeat:
 	/* skip whitespace first */
-	for (c = getc(yyfp); c == ' ' || c == '\t'; c = getc(yyfp))
+	for (c = lgetc(); c == ' ' || c == '\t'; c = lgetc())
 		yylval.colno++;
 
 	/* check for special one-character constructions */
@@ -244,24 +632,46 @@ repeat:
 		case '\n':
 			yylval.colno = 0;
 			yylval.lineno++;
+			optpos = 0;
 			/* FALLTHROUGH */
 		case '{':
 		case '}':
+			inbraces = c == '{';
 			return c;
 		case '#':
 			/* skip comments; NUL is allowed; no continuation */
-			while ((c = getc(yyfp)) != '\n')
+			while ((c = lgetc()) != '\n')
 				if (c == EOF)
 					goto eof;
 			yylval.colno = 0;
 			yylval.lineno++;
+			optpos = inbraces = 0;
 			return c;
 		case EOF:
 			goto eof;
 	}
 
+	/*
+	 * Most words contain no quotes or escapes, and can be taken from the
+	 * buffer as they are. Anything else goes through the loop below.
+	 */
+	start = end = yypos - 1;
+	while (end < yylen && !special[(unsigned char)yybuf[end]])
+		end++;
+	if (end > start && end - start < sizeof(buf) && (end == yylen ||
+	    (yybuf[end] != '\\' && yybuf[end] != '"' && yybuf[end] != '\0'))) {
+		yypos = end;
+		yylval.colno += end - start;
+		if ((kw = kwlookup(yybuf + start, end - start)) != NULL)
+			return lexword(kw->token);
+		if ((tok = timeoutword(yybuf + start, end - start)) != 0)
+			return tok;
+		yylval.str = strintern(yybuf + start, end - start, 1);
+		return lexword(TSTRING);
+	}
+
 	/* parsing next word */
-	for (;; c = getc(yyfp), yylval.colno++) {
+	for (;; c = lgetc(), yylval.colno++) {
 		switch (c) {
 		case '\0':
 			yyerror("unallowed character NUL in column %lu",
@@ -326,7 +736,7 @@ repeat:
 eow:
 	*p = 0;
 	if (c != EOF)
-		ungetc(c, yyfp);
+		lungetc();
 	if (p == buf) {
 		/*
 		 * There could be a number of reasons for empty buffer,
@@ -338,19 +748,19 @@ eow:
 		else if (!quoted)    /* accept, e.g., empty args: cmd foo args "" */
 			goto repeat;
 	}
-	if (!nonkw) {
-		for (i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
-			if (strcmp(buf, keywords[i].word) == 0)
-				return keywords[i].token;
-		}
-	}
-	if ((str = strdup(buf)) == NULL)
-		err(1, "%s", __func__);
-	yylval.str = str;
-	return TSTRING;
+	if (!nonkw && (kw = kwlookup(buf, p - buf)) != NULL)
+		return lexword(kw->token);
+	if (!nonkw && (tok = timeoutword(buf, p - buf)) != 0)
+		return tok;
+	yylval.str = strintern(buf, p - buf, 1);
+	return lexword(TSTRING);
 
 eof:
-	if (ferror(yyfp))
+	if (yyreaderr)
 		yyerror("input error reading config");
+	free(yybuf);
+	yybuf = NULL;
+	yylen = yypos = 0;
+	yyreaderr = 0;
 	return 0;
 }
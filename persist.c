@@ -19,95 +19,142 @@
  * example code for comparison.
  */
 
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+
+#include <linux/magic.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "bsd-compat/compat.h"
 #include "persist.h"
 
-#ifndef DOAS_STATE_DIR
-#define DOAS_STATE_DIR "/var/lib/doas"
+/* Where token files are kept, whether that is in volatile storage, and
+   how old a valid token must be to be stamped again. These are only
+   changed from their defaults by the benchmarks. */
+const char *persist_state_dir = DOAS_STATE_DIR;
+#ifdef DOAS_VOLATILE_STATE
+int persist_volatile = 1;
+#else
+int persist_volatile = 0;
 #endif
+int persist_refresh = DOAS_PERSIST_REFRESH;
+
+/* Extract the seventh and twenty-second fields, the number of the
+   controlling tty and the start time, from the len bytes of a
+   /proc/<pid>/stat file in buf; see proc(5). The second field is the
+   command name in parentheses, which may itself contain spaces and
+   parentheses, so the fields are counted from the last closing
+   parenthesis. This is done in one pass, without copying. */
+int parsestat(const char *buf, size_t len, int *ttynr,
+              unsigned long long *starttime) {
+    const char *p, *end = buf + len;
+    unsigned long long v;
+    int field, neg;
+
+    if ((p = memrchr(buf, ')', len)) == NULL)
+        return -1;
+    p++;
 
-#ifndef DOAS_PERSIST_TIMEOUT
-#define DOAS_PERSIST_TIMEOUT 300 /* Five minutes */
-#endif
+    for (field = 3; field <= 22; field++) {
+        if (p == end || *p++ != ' ')
+            return -1;
 
+        if (field != 7 && field != 22) {
+            if ((p = memchr(p, ' ', end - p)) == NULL)
+                return -1;
+            continue;
+        }
 
-/* Credit for this function goes to Duncan Overbruck. Flameage for this
-   function goes to multiplexd. */
-static int gettsfilename(char *name, size_t namelen) {
-    char buf[1024], path[PATH_MAX], *p, *ep;
-    const char *errstr;
-    pid_t ppid, sid;
-    int fd, r, ttynr;
-    unsigned long long starttime;
+        neg = field == 7 && p < end && *p == '-';
+        if (neg)
+            p++;
+        if (p == end || *p < '0' || *p > '9')
+            return -1;
+        for (v = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (v > (ULLONG_MAX - (*p - '0')) / 10)
+                return -1;
+            v = v * 10 + (*p - '0');
+        }
 
-    /* Find our session leader, the number of their controlling tty, and their
-       start time. */
-    if ((sid = getsid(0)) == -1)
-        return -1;
+        if (field == 7) {
+            if (v > (unsigned long long)INT_MAX + neg)
+                return -1;
+            *ttynr = neg ? (int)-(long long)v : (int)v;
+        } else
+            *starttime = v;
+    }
+
+    /* The start time must have been read whole */
+    return (p == end || *p == ' ' || *p == '\n') ? 0 : -1;
+}
 
-    if (snprintf(path, sizeof(path), "/proc/%u/stat", sid) >= sizeof(path))
+/* Find the number of the controlling tty and the start time of process
+   pid from /proc. Fails with errno set on every path, to ENOENT or ESRCH
+   only if there is no such process, which staletoken() relies on. */
+int procstat(pid_t pid, int *ttynr, unsigned long long *starttime) {
+    char buf[1024], path[32];
+    size_t len = 0;
+    ssize_t r;
+    int fd;
+
+    if (snprintf(path, sizeof(path), "/proc/%u/stat", pid) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
         return -1;
+    }
 
     if ((fd = open(path, O_RDONLY)) == -1)
         return -1;
 
-    p = buf;
-    while ((r = read(fd, p, buf + (sizeof(buf) - 1) - p)) != 0) {
+    /* The whole line is nearly always returned by the first read, and
+       ends in a newline, so there is no need to read again to find the
+       end of the file */
+    while (len < sizeof(buf) && (len == 0 || buf[len - 1] != '\n')) {
+        r = read(fd, buf + len, sizeof(buf) - len);
         if (r == -1) {
             if (errno == EAGAIN || errno == EINTR)
                 continue;
             close(fd);
             return -1;
         }
-        p += r;
+        if (r == 0)
+            break;
+        len += r;
     }
     close(fd);
 
-    /* Discard the buffer if it contains NUL chars, as we can't safely parse it
-       in that case */
-    if (memchr(buf, '\0', p - buf - 1) != NULL)
+    if (parsestat(buf, len, ttynr, starttime) == -1) {
+        errno = EINVAL;
         return -1;
+    }
 
-    *p = '\0';
+    return 0;
+}
+
+/* Credit for this function goes to Duncan Overbruck. Flameage for this
+   function goes to multiplexd. */
+int gettsfilename(char *name, size_t namelen) {
+    pid_t ppid, sid;
+    int ttynr;
+    unsigned long long starttime;
 
-    /* We parse from the end of the second field by spaces, as the
-       second field can itself contain spaces */
-    if ((p = strrchr(buf, ')')) == NULL)
+    /* Find our session leader, the number of their controlling tty, and their
+       start time. */
+    if ((sid = getsid(0)) == -1)
         return -1;
 
-    /* We want the seventh and twenty-second fields; see proc(5) */
-    r = 2;
-    for ((p = strtok(p, " ")); p; (p = strtok(NULL, " "))) {
-        switch (r++) {
-        case 7:
-            ttynr = strtonum(p, INT_MIN, INT_MAX, &errstr);
-            if (errstr)
-                return -1;
-            break;
-        case 22:
-            errno = 0;
-            starttime = strtoull(p, &ep, 10);
-            if (p == ep || (errno == ERANGE && starttime == ULLONG_MAX))
-                return -1;
-            break;
-        }
-        if (r == 23)
-            break;
-    }
+    if (procstat(sid, &ttynr, &starttime) == -1)
+        return -1;
 
     ppid = getppid();
     if (snprintf(name, namelen, "%d_%d_%d_%llu_%d",
@@ -118,138 +165,238 @@ static int gettsfilename(char *name, size_t namelen) {
     return 0;
 }
 
-/* Assumes the process has a controlling tty. */
-int persist_check(int *authfd, int *dirfd, char *name, size_t namesz, char *tmp, size_t tmpsz) {
-    const char *state_dir = DOAS_STATE_DIR;
-    int fd, sfd;
-    struct stat nodeinfo;
-    struct timespec now;
-
-    /* Open state directory and verify permissions */
-    if ((sfd = open(state_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1)
-        return PERSIST_ERROR;
-
-    if (fstat(sfd, &nodeinfo) == -1)
-        goto closedir;
-
-    if (nodeinfo.st_uid != 0 || nodeinfo.st_gid != 0 ||
-        nodeinfo.st_mode != (S_IRWXU | S_IFDIR))
-        goto closedir;
-
-    /* Get the name of the timestamp file */
-    if (gettsfilename(name, namesz) == -1)
-        goto closedir;
-
-    fd = openat(sfd, name, O_RDWR | O_SYNC | O_NOFOLLOW);
-    if (fd == -1) {
-        if (errno == ENOENT) {
-            /* Timestamp file doesn't exist, so create temporary file to be
-               renamed if authentication succeeds */
-
-            if (snprintf(tmp, tmpsz, "tmp.%s.%d", name, getpid()) >= tmpsz)
-                goto closedir;
-
-            fd = openat(sfd, tmp, O_RDWR | O_CREAT | O_SYNC, 0600);
-            if (fd == -1)
-                goto closedir;
+/* Where the unified (version 2) cgroup hierarchy may be mounted: on its
+   own, or beside the version 1 hierarchies */
+static const char *const cgroupmounts[] = {
+    "/sys/fs/cgroup", "/sys/fs/cgroup/unified", NULL
+};
+
+/* Find the path of our cgroup in the unified hierarchy, from the line of
+   /proc/self/cgroup which starts with "0::"; see cgroups(7). */
+static int cgrouppath(char *path, size_t pathlen) {
+    char buf[8192], *p, *end;
+    size_t len = 0;
+    ssize_t r;
+    int fd;
+
+    if ((fd = open("/proc/self/cgroup", O_RDONLY)) == -1)
+        return -1;
 
-            *authfd = fd;
-            *dirfd = sfd;
-            return PERSIST_NEW;
-        } else
-            goto closedir;
+    while (len < sizeof(buf) - 1) {
+        r = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        if (r == 0)
+            break;
+        len += r;
+    }
+    close(fd);
+    buf[len] = '\0';
+
+    for (p = buf; p != NULL && *p != '\0'; p = strchr(p, '\n')) {
+        if (*p == '\n')
+            p++;
+        if (strncmp(p, "0::/", 4) != 0)
+            continue;
+        p += 3;
+        if ((end = strchr(p, '\n')) == NULL)
+            return -1;
+        if (end - p >= pathlen)
+            return -1;
+        memcpy(path, p, end - p);
+        path[end - p] = '\0';
+        return 0;
     }
 
-    /* Now finished with state directory */
-    close(sfd);
-
-    /* Check permissions of token file */
-    if (fstat(fd, &nodeinfo) == -1)
-        goto closefd;
+    return -1;
+}
 
-    if (nodeinfo.st_uid != 0 || nodeinfo.st_gid != 0 ||
-        nodeinfo.st_mode != (S_IRUSR | S_IWUSR | S_IFREG))
-        goto closefd;
+/* Make the name of a token kept for our cgroup rather than our session,
+   from the path of the cgroup and its inode number, which the kernel
+   doesn't give to another cgroup once it is removed. Any process of the
+   user in the cgroup may use the token, so it must be one they can't
+   move a process of theirs into: neither it nor its cgroup.procs may be
+   owned by anyone but root or be writable by group or other. The root
+   cgroup, which every process not put in another one is in, is no scope
+   at all, and is told apart by having no cgroup.events. */
+int getcgfilename(char *name, size_t namelen) {
+    char path[PATH_MAX];
+    struct statfs fsinfo;
+    struct stat nodeinfo, procsinfo;
+    uint64_t hash;
+    const char *p;
+    int fd, mfd = -1, i;
+
+    if (cgrouppath(path, sizeof(path)) == -1)
+        return -1;
 
-    /* This is a Linuxism. On Linux, CLOCK_MONOTONIC does not run while
-       the machine is suspended. */
-    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
-        goto closefd;
+    for (i = 0; cgroupmounts[i] != NULL; i++) {
+        mfd = open(cgroupmounts[i], O_RDONLY | O_DIRECTORY);
+        if (mfd == -1)
+            continue;
+        if (fstatfs(mfd, &fsinfo) == 0 && fsinfo.f_type == CGROUP2_SUPER_MAGIC)
+            break;
+        close(mfd);
+        mfd = -1;
+    }
+    if (mfd == -1)
+        return -1;
 
-    *authfd = fd;
+    fd = path[1] == '\0' ? dup(mfd) :
+         openat(mfd, path + 1, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    close(mfd);
+    if (fd == -1)
+        return -1;
 
-    if (now.tv_sec < nodeinfo.st_mtim.tv_sec)
-        /* Timestamp is in future, and is thus invalid */
-        return PERSIST_INVALID;
+    if (fstat(fd, &nodeinfo) == -1 ||
+        fstatat(fd, "cgroup.procs", &procsinfo, AT_SYMLINK_NOFOLLOW) == -1 ||
+        faccessat(fd, "cgroup.events", F_OK, AT_SYMLINK_NOFOLLOW) == -1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
 
-    if ((now.tv_sec - nodeinfo.st_mtim.tv_sec) > DOAS_PERSIST_TIMEOUT)
-        /* Difference between now and the timestamp is greater than the
-           configured timeout */
-        return PERSIST_INVALID;
+    if (nodeinfo.st_uid != 0 || (nodeinfo.st_mode & (S_IWGRP | S_IWOTH)) ||
+        procsinfo.st_uid != 0 || (procsinfo.st_mode & (S_IWGRP | S_IWOTH)))
+        return -1;
 
-    /* Timestamp is within the timeout */
-    return PERSIST_OK;
+    /* FNV-1a, as the path may be too long for a file name */
+    hash = 0xcbf29ce484222325ULL;
+    for (p = path; *p != '\0'; p++)
+        hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
 
-closefd:
-    close(fd);
-    return PERSIST_ERROR;
+    if (snprintf(name, namelen, "%d_cg_%llu_%016llx", getuid(),
+                 (unsigned long long)nodeinfo.st_ino,
+                 (unsigned long long)hash) >= namelen)
+        return -1;
 
-closedir:
-    close(sfd);
-    return PERSIST_ERROR;
+    return 0;
 }
 
-void persist_update(int fd) {
-    struct timespec spec[2];
-
-    /* Only update the last modification time */
-    spec[0].tv_nsec = UTIME_OMIT;
-
-    /* This is a Linuxism. See above. */
-    if (clock_gettime(CLOCK_BOOTTIME, &spec[1]) == -1)
-        return;
+/* Make the name of the token of the given scope, PERSIST_TTY or
+   PERSIST_CGROUP. */
+int gettokenname(char *name, size_t namelen, int scope) {
+    if (scope == PERSIST_CGROUP)
+        return getcgfilename(name, namelen);
+    return gettsfilename(name, namelen);
+}
 
-    (void) futimens(fd, spec);
-    close(fd);
+/* Decide whether the token called name, last stamped at stamp, can be
+   removed: because it is older than timeout, or because the session or
+   the parent process it was made for is gone, in which case it can never
+   be used again. A token kept for a cgroup is only removed once it is
+   older than timeout. Names which aren't those of tokens are never
+   stale. */
+int staletoken(const char *name, time_t stamp, time_t now, time_t timeout) {
+    unsigned long long starttime, tstarttime, ino, hash;
+    long long sid, ppid;
+    int ttynr, tttynr, n;
+    unsigned int uid;
+
+    n = -1;
+    if (sscanf(name, "%u_cg_%llu_%llx%n", &uid, &ino, &hash, &n) == 3 &&
+        name[n] == '\0')
+        return now < stamp || (now - stamp) > timeout;
+
+    n = -1;
+    if (sscanf(name, "%u_%d_%lld_%llu_%lld%n", &uid, &tttynr, &sid,
+               &tstarttime, &ppid, &n) != 5 || name[n] != '\0' ||
+        sid <= 0 || sid > INT_MAX || ppid <= 0 || ppid > INT_MAX)
+        return 0;
+
+    if (now < stamp || (now - stamp) > timeout)
+        return 1;
+
+    /* A session leader which has gone away, or been replaced by another
+       process with the same ID, can't come back */
+    if (procstat(sid, &ttynr, &starttime) == -1)
+        return errno == ENOENT || errno == ESRCH;
+    if (starttime != tstarttime || ttynr != tttynr)
+        return 1;
+
+    return kill(ppid, 0) == -1 && errno == ESRCH;
 }
 
-void persist_commit(int dirfd, char *from, char *to) {
-    (void) renameat(dirfd, from, dirfd, to);
-    close(dirfd);
+/* Decide whether the valid token checked into ps was stamped recently
+   enough to be left as it is. Its remaining lifetime is then still more
+   than its timeout less persist_refresh, so a token left unstamped
+   expires at most persist_refresh seconds sooner after its last use than
+   it would have; this is the price of the saved write, and only the file
+   and slots backends, which have nowhere cheaper to record the use, pay
+   it. A granularity no shorter than the token's timeout would let it
+   expire while in use, so is not applied. */
+int stampfresh(const struct persist *ps, time_t now) {
+    return ps->stamp != -1 && persist_refresh < ps->timeout &&
+           now - ps->stamp < persist_refresh;
 }
 
-int persist_clear() {
-    const char *state_dir = DOAS_STATE_DIR;
+/* Open the directory called name below dirfd and verify that only root
+   can use it, creating it first, as root's, if create is set. Fails with
+   errno set, to EPERM if anyone else could. */
+int openstatedirat(int dirfd, const char *name, int create) {
     struct stat nodeinfo;
-    char tsname[PATH_MAX];
-    int dirfd;
-    int r, e;
-
-    /* Open and check the state directory */
-
-    if ((dirfd = open(state_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1)
+    int fd, made = 0;
+
+    /* Creating it takes the lock on dirfd even if it exists, so only try
+       once it is known not to */
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd == -1 && errno == ENOENT && create) {
+        if (mkdirat(dirfd, name, S_IRWXU) == 0)
+            made = 1;
+        else if (errno != EEXIST)
+            return -1;
+        fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (fd == -1)
         return -1;
 
-    if (fstat(dirfd, &nodeinfo) == -1) {
-        close(dirfd);
-        return -1;
-    }
+    /* The mode of a new directory is subject to the umask, and its group
+       is that of the invoking user unless doas is also setgid */
+    if (made && (fchown(fd, 0, 0) == -1 || fchmod(fd, S_IRWXU) == -1))
+        goto closedir;
+
+    if (fstat(fd, &nodeinfo) == -1)
+        goto closedir;
 
     if (nodeinfo.st_uid != 0 || nodeinfo.st_gid != 0 ||
-         nodeinfo.st_mode != (S_IRWXU | S_IFDIR)) {
-        close(dirfd);
-        return -1;
+        nodeinfo.st_mode != (S_IRWXU | S_IFDIR)) {
+        errno = EPERM;
+        goto closedir;
     }
 
-    if (gettsfilename(tsname, sizeof(tsname)) == -1) {
-        close(dirfd);
+    return fd;
+
+closedir:
+    close(fd);
+    return -1;
+}
+
+/* Open the state directory and verify that only root can use it,
+   creating it first if create is set. In volatile mode it must also be on
+   a tmpfs, failing with EXDEV if not. */
+int openstatedir(int create) {
+    struct statfs fsinfo;
+    int fd;
+
+    if ((fd = openstatedirat(AT_FDCWD, persist_state_dir, create)) == -1)
         return -1;
+
+    if (persist_volatile) {
+        if (fstatfs(fd, &fsinfo) == -1)
+            goto closedir;
+        if (fsinfo.f_type != TMPFS_MAGIC) {
+            errno = EXDEV;
+            goto closedir;
+        }
     }
 
-    r = unlinkat(dirfd, tsname, 0);
-    e = errno;
-    close(dirfd);
+    return fd;
 
-    return (r == 0 || (r == -1 && e == ENOENT)) ? 0 : -1;
+closedir:
+    close(fd);
+    return -1;
 }
-
@@ -17,14 +17,76 @@
 #ifndef _PERSIST_H
 #define _PERSIST_H
 
-int persist_check(int *, int *, char *, size_t, char *, size_t);
-void persist_update(int);
-void persist_commit(int, char *, char *);
-int persist_clear(void);
+#include <sys/types.h>
+
+#include <limits.h>
+#include <time.h>
+
+#ifndef DOAS_STATE_DIR
+#ifdef DOAS_VOLATILE_STATE
+#define DOAS_STATE_DIR "/run/doas"
+#else
+#define DOAS_STATE_DIR "/var/lib/doas"
+#endif
+#endif
+
+/* Unless the rule gives a timeout of its own */
+#ifndef DOAS_PERSIST_TIMEOUT
+#define DOAS_PERSIST_TIMEOUT 300 /* Five minutes */
+#endif
+
+/* A valid token is only stamped again once it is this many seconds old */
+#ifndef DOAS_PERSIST_REFRESH
+#define DOAS_PERSIST_REFRESH 0
+#endif
+
+#if DOAS_PERSIST_REFRESH >= DOAS_PERSIST_TIMEOUT
+#error "PERSIST_REFRESH must be less than PERSIST_TIMEOUT"
+#endif
+
+/* State of one persistent authentication token between check and update.
+   Each backend uses the fields it needs. */
+struct persist {
+    int fd;                 /* token file, or token table */
+    int dirfd;              /* state directory, while a new token is made */
+    char name[PATH_MAX];    /* token name, from gettokenname() */
+    char tmp[PATH_MAX];     /* temporary name of a new token file */
+    time_t stamp;           /* when a valid token was last stamped, or -1 */
+    time_t timeout;         /* how long a token is valid for */
+    int indaemon;           /* kept by doasd rather than in a file, if set */
+};
+
+extern const char *persist_state_dir;
+extern int persist_volatile;
+extern int persist_refresh;
+
+int parsestat(const char *, size_t, int *, unsigned long long *);
+int procstat(pid_t, int *, unsigned long long *);
+int gettsfilename(char *, size_t);
+int getcgfilename(char *, size_t);
+int gettokenname(char *, size_t, int);
+int staletoken(const char *, time_t, time_t, time_t);
+int stampfresh(const struct persist *, time_t);
+int openstatedirat(int, const char *, int);
+int openstatedir(int);
+
+int persist_check(struct persist *, time_t, int);
+int persist_update(struct persist *);
+void persist_commit(struct persist *);
+int persist_clear(int);
+int persist_reap(time_t);
+
+/* What a token is kept for */
+#define PERSIST_TTY     0   /* the session on the controlling tty */
+#define PERSIST_CGROUP  1   /* the cgroup, whether or not there is a tty */
 
 #define PERSIST_ERROR  -1
 #define PERSIST_OK      0
 #define PERSIST_INVALID 1
 #define PERSIST_NEW     2
 
+/* Results of persist_update() */
+#define PERSIST_STAMPED 1
+#define PERSIST_FRESH   0
+
 #endif /* _PERSIST_H */
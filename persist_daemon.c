@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Daemon backend. Tokens are kept in memory by doasd, which is asked
+   about them over a socket in the state directory, so that checking and
+   stamping a token touches no file. When doasd is not running, tokens are
+   kept in files exactly as by the file backend, which is linked in
+   alongside this one under other names. */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bsd-compat/compat.h"
+#include "persist.h"
+#include "persist_file.h"
+#include "doasd.h"
+
+/* The value of ps->indaemon for a valid token, which doasd stamped again
+   when it was checked */
+#define DAEMON_STAMPED 2
+
+/* Connect to doasd, and make sure that it is running as root. Fails with
+   ENOENT or ECONNREFUSED if it isn't running at all. */
+static int doasd_connect(void) {
+    struct sockaddr_un sun;
+    struct timeval tv = { DOASD_TIMEOUT, 0 };
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s",
+                 persist_state_dir, DOASD_SOCKET) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+        goto closefd;
+
+    /* Only root can make the socket in the state directory, but it is no
+       more work to ask */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        goto closefd;
+    if (cred.uid != 0) {
+        errno = EPERM;
+        goto closefd;
+    }
+
+    /* A wedged doasd must not hang doas */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+        goto closefd;
+
+    return fd;
+
+closefd:
+    close(fd);
+    return -1;
+}
+
+/* Whether connecting failed only because doasd isn't running */
+static int doasd_absent(int e) {
+    return e == ENOENT || e == ECONNREFUSED;
+}
+
+/* Send the request in m to doasd on fd and read its answer into m. */
+static int doasd_call(int fd, struct doasd_msg *m) {
+    ssize_t r;
+
+    if (send(fd, m, sizeof(*m), MSG_NOSIGNAL) != sizeof(*m))
+        return -1;
+
+    do
+        r = recv(fd, m, sizeof(*m), 0);
+    while (r == -1 && errno == EINTR);
+
+    return (r == sizeof(*m) && m->op == 0) ? 0 : -1;
+}
+
+/* Assumes the process has a controlling tty, unless scope is
+   PERSIST_CGROUP. */
+int persist_check(struct persist *ps, time_t timeout, int scope) {
+    struct doasd_msg m;
+    struct timespec now;
+    int fd, r;
+
+    ps->indaemon = 0;
+
+    if ((fd = doasd_connect()) == -1) {
+        if (doasd_absent(errno))
+            return file_persist_check(ps, timeout, scope);
+        return PERSIST_ERROR;
+    }
+
+    ps->fd = -1;
+    ps->dirfd = -1;
+    ps->stamp = -1;
+    ps->timeout = timeout;
+    ps->indaemon = 1;
+
+    /* Get the name of the token */
+    memset(&m, 0, sizeof(m));
+    if (gettokenname(ps->name, sizeof(ps->name), scope) == -1 ||
+        strlcpy(m.name, ps->name, sizeof(m.name)) >= sizeof(m.name)) {
+        close(fd);
+        return PERSIST_ERROR;
+    }
+
+    /* A valid token is stamped again by doasd there and then */
+    m.op = DOASD_USE;
+    m.timeout = timeout;
+    r = doasd_call(fd, &m);
+    close(fd);
+    if (r == -1)
+        return PERSIST_ERROR;
+
+    if (m.stamp == -1)
+        return PERSIST_NEW;
+
+    /* This is a Linuxism. On Linux, CLOCK_MONOTONIC does not run while
+       the machine is suspended. doasd stamps tokens by the same clock. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        return PERSIST_ERROR;
+
+    if (now.tv_sec < m.stamp || (now.tv_sec - m.stamp) > timeout)
+        return PERSIST_INVALID;
+
+    ps->stamp = m.stamp;
+    ps->indaemon = DAEMON_STAMPED;
+    return PERSIST_OK;
+}
+
+int persist_update(struct persist *ps) {
+    struct doasd_msg m;
+    int fd, r;
+
+    switch (ps->indaemon) {
+    case 0:
+        return file_persist_update(ps);
+    case DAEMON_STAMPED:
+        return PERSIST_STAMPED;
+    }
+
+    /* A new or expired token, which is only stamped now that the user
+       has authenticated */
+    if ((fd = doasd_connect()) == -1)
+        return PERSIST_ERROR;
+
+    memset(&m, 0, sizeof(m));
+    m.op = DOASD_SET;
+    m.timeout = ps->timeout;
+    strlcpy(m.name, ps->name, sizeof(m.name));
+    r = doasd_call(fd, &m);
+    close(fd);
+
+    return r == 0 ? PERSIST_STAMPED : PERSIST_ERROR;
+}
+
+void persist_commit(struct persist *ps) {
+    /* Nothing to do for doasd, the token is stored by persist_update() */
+    if (!ps->indaemon)
+        file_persist_commit(ps);
+}
+
+/* Clear the token both from doasd and from the files it may have been
+   kept in before doasd was started. */
+int persist_clear(int scope) {
+    struct doasd_msg m;
+    int fd, r;
+
+    r = file_persist_clear(scope);
+
+    if ((fd = doasd_connect()) == -1)
+        return doasd_absent(errno) ? r : -1;
+
+    memset(&m, 0, sizeof(m));
+    m.op = DOASD_DEL;
+    if (gettokenname(m.name, sizeof(m.name), scope) == -1 ||
+        doasd_call(fd, &m) == -1)
+        r = -1;
+    close(fd);
+
+    return r;
+}
+
+/* doasd removes stale tokens from memory by itself, so only the files
+   need reaping. */
+int persist_reap(time_t timeout) {
+    return file_persist_reap(timeout);
+}
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2018 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Thanks to Duncan Overbruck for pointing out various issues with the
+ * previous versions of this code and with suggestions for alternative
+ * example code for comparison.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bsd-compat/compat.h"
+#include "persist.h"
+#include "persist_file.h"
+
+/* Open the directory holding the tokens of the invoking user, below the
+   state directory open on sfd, creating it if create is set. Each user has
+   their own, so that many invocations at once by different users don't all
+   contend for one directory. */
+static int openuserdir(int sfd, int create) {
+    char name[32];
+
+    if (snprintf(name, sizeof(name), "%u", getuid()) >= sizeof(name))
+        return -1;
+
+    return openstatedirat(sfd, name, create);
+}
+
+/* Assumes the process has a controlling tty, unless scope is
+   PERSIST_CGROUP. */
+int file_persist_check(struct persist *ps, time_t timeout, int scope) {
+    int fd, sfd, sync;
+    struct stat nodeinfo;
+    struct timespec now;
+
+    ps->stamp = -1;
+    ps->timeout = timeout;
+
+    /* Open state directory and the user's directory below it, and verify
+       permissions */
+    if ((fd = openstatedir(0)) == -1)
+        return PERSIST_ERROR;
+
+    sfd = openuserdir(fd, 1);
+    close(fd);
+    if (sfd == -1)
+        return PERSIST_ERROR;
+
+    /* Tokens in volatile storage can't outlive a reboot anyway, so there
+       is no point in writing them synchronously */
+    sync = persist_volatile ? 0 : O_SYNC;
+
+    /* Get the name of the timestamp file */
+    if (gettokenname(ps->name, sizeof(ps->name), scope) == -1)
+        goto closedir;
+
+    fd = openat(sfd, ps->name, O_RDWR | sync | O_NOFOLLOW);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            /* Timestamp file doesn't exist, so create temporary file to be
+               renamed if authentication succeeds */
+
+            if (snprintf(ps->tmp, sizeof(ps->tmp), "tmp.%s.%d", ps->name,
+                         getpid()) >= sizeof(ps->tmp))
+                goto closedir;
+
+            fd = openat(sfd, ps->tmp, O_RDWR | O_CREAT | sync, 0600);
+            if (fd == -1)
+                goto closedir;
+
+            ps->fd = fd;
+            ps->dirfd = sfd;
+            return PERSIST_NEW;
+        } else
+            goto closedir;
+    }
+
+    /* Now finished with the user's directory */
+    close(sfd);
+
+    /* Check permissions of token file */
+    if (fstat(fd, &nodeinfo) == -1)
+        goto closefd;
+
+    if (nodeinfo.st_uid != 0 || nodeinfo.st_gid != 0 ||
+        nodeinfo.st_mode != (S_IRUSR | S_IWUSR | S_IFREG))
+        goto closefd;
+
+    /* This is a Linuxism. On Linux, CLOCK_MONOTONIC does not run while
+       the machine is suspended. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        goto closefd;
+
+    ps->fd = fd;
+    ps->dirfd = -1;
+
+    if (now.tv_sec < nodeinfo.st_mtim.tv_sec)
+        /* Timestamp is in future, and is thus invalid */
+        return PERSIST_INVALID;
+
+    if ((now.tv_sec - nodeinfo.st_mtim.tv_sec) > timeout)
+        /* Difference between now and the timestamp is greater than the
+           configured timeout */
+        return PERSIST_INVALID;
+
+    /* Timestamp is within the timeout */
+    ps->stamp = nodeinfo.st_mtim.tv_sec;
+    return PERSIST_OK;
+
+closefd:
+    close(fd);
+    return PERSIST_ERROR;
+
+closedir:
+    close(sfd);
+    return PERSIST_ERROR;
+}
+
+int file_persist_update(struct persist *ps) {
+    struct timespec spec[2];
+    int r = PERSIST_STAMPED;
+
+    /* Only update the last modification time */
+    spec[0].tv_nsec = UTIME_OMIT;
+
+    /* This is a Linuxism. See above. A valid token which was stamped
+       recently enough is left as it is, saving a write. */
+    if (clock_gettime(CLOCK_BOOTTIME, &spec[1]) == -1)
+        r = PERSIST_ERROR;
+    else if (stampfresh(ps, spec[1].tv_sec))
+        r = PERSIST_FRESH;
+    else if (futimens(ps->fd, spec) == -1)
+        r = PERSIST_ERROR;
+
+    close(ps->fd);
+    return r;
+}
+
+void file_persist_commit(struct persist *ps) {
+    (void) renameat(ps->dirfd, ps->tmp, ps->dirfd, ps->name);
+    close(ps->dirfd);
+}
+
+int file_persist_clear(int scope) {
+    char tsname[PATH_MAX];
+    int dirfd, sfd;
+    int r, e;
+
+    /* Open and check the state directory, and the user's directory below
+       it, which there is no need for until they have a token */
+
+    if ((sfd = openstatedir(0)) == -1)
+        return -1;
+
+    dirfd = openuserdir(sfd, 0);
+    e = errno;
+    close(sfd);
+    if (dirfd == -1)
+        return e == ENOENT ? 0 : -1;
+
+    if (gettokenname(tsname, sizeof(tsname), scope) == -1) {
+        close(dirfd);
+        return -1;
+    }
+
+    r = unlinkat(dirfd, tsname, 0);
+    e = errno;
+    close(dirfd);
+
+    return (r == 0 || (r == -1 && e == ENOENT)) ? 0 : -1;
+}
+
+/* As returned by getdents64(2), which is called directly so that the
+   directory can be read in batches much larger than readdir(3)'s. */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define REAP_BATCH (256 * 1024)
+
+/* Decide whether the directory entry called name is a stale token file or
+   a temporary file left behind by an invocation which never finished. */
+static int staleentry(int dirfd, const char *name, time_t now, time_t rnow,
+                      time_t timeout) {
+    struct stat nodeinfo;
+    const char *p;
+    long long pid;
+    int n;
+
+    if (fstatat(dirfd, name, &nodeinfo, AT_SYMLINK_NOFOLLOW) == -1 ||
+        !S_ISREG(nodeinfo.st_mode))
+        return 0;
+
+    if (strncmp(name, "tmp.", 4) == 0) {
+        /* Named "tmp.<token>.<pid>", and stamped by the real time clock
+           until it is renamed */
+        if ((p = strrchr(name, '.')) == name + 3)
+            return 0;
+        n = -1;
+        if (sscanf(p + 1, "%lld%n", &pid, &n) != 1 || p[1 + n] != '\0' ||
+            pid <= 0 || pid > INT_MAX)
+            return 0;
+        if (kill(pid, 0) == -1 && errno == ESRCH)
+            return 1;
+        return (rnow - nodeinfo.st_mtim.tv_sec) > timeout;
+    }
+
+    return staletoken(name, nodeinfo.st_mtim.tv_sec, now, timeout);
+}
+
+/* Remove the stale entries of the directory open on dirfd, and those of
+   the per-user directories in it if users is set. */
+static int reapdir(int dirfd, time_t now, time_t rnow, time_t timeout,
+                   int users) {
+    struct linux_dirent64 *d;
+    struct stat nodeinfo;
+    const char *errstr;
+    char *buf;
+    long n, off;
+    int fd, type, r = 0;
+
+    if ((buf = malloc(REAP_BATCH)) == NULL)
+        return -1;
+
+    while ((n = syscall(SYS_getdents64, dirfd, buf, REAP_BATCH)) > 0) {
+        for (off = 0; off < n; off += d->d_reclen) {
+            d = (struct linux_dirent64 *)(buf + off);
+
+            /* Not every filesystem reports the type of each entry */
+            type = d->d_type;
+            if (type == DT_UNKNOWN && fstatat(dirfd, d->d_name, &nodeinfo,
+                                              AT_SYMLINK_NOFOLLOW) == 0)
+                type = IFTODT(nodeinfo.st_mode);
+
+            if (type == DT_DIR && users) {
+                (void) strtonum(d->d_name, 0, UINT_MAX, &errstr);
+                if (errstr)
+                    continue;
+                if ((fd = openstatedirat(dirfd, d->d_name, 0)) == -1) {
+                    r = -1;
+                    continue;
+                }
+                if (reapdir(fd, now, rnow, timeout, 0) == -1)
+                    r = -1;
+                close(fd);
+                continue;
+            }
+
+            if (type != DT_REG)
+                continue;
+            if (!staleentry(dirfd, d->d_name, now, rnow, timeout))
+                continue;
+            if (unlinkat(dirfd, d->d_name, 0) == -1 && errno != ENOENT)
+                r = -1;
+        }
+    }
+    if (n == -1)
+        r = -1;
+
+    free(buf);
+    return r;
+}
+
+/* Remove every token older than timeout or which can no longer be used,
+   and any temporary file left behind. Token files directly in the state
+   directory were made before it had a directory per user, and are removed
+   once they are stale like any other. */
+int file_persist_reap(time_t timeout) {
+    struct timespec now, rnow;
+    int dirfd, r;
+
+    /* This is a Linuxism. See above. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1 ||
+        clock_gettime(CLOCK_REALTIME, &rnow) == -1)
+        return -1;
+
+    if ((dirfd = openstatedir(0)) == -1)
+        return -1;
+
+    /* An expired token may be in the middle of being stamped again, in
+       which case its session has to authenticate once more. Anything
+       missed is picked up by the next run. */
+    r = reapdir(dirfd, now.tv_sec, rnow.tv_sec, timeout, 1);
+
+    close(dirfd);
+    return r;
+}
+
+#ifndef DOAS_PERSIST_DAEMON
+/* Built on its own, this is the backend. The daemon backend calls the
+   functions above itself while doasd isn't running. */
+int persist_check(struct persist *ps, time_t timeout, int scope) {
+    return file_persist_check(ps, timeout, scope);
+}
+
+int persist_update(struct persist *ps) {
+    return file_persist_update(ps);
+}
+
+void persist_commit(struct persist *ps) {
+    file_persist_commit(ps);
+}
+
+int persist_clear(int scope) {
+    return file_persist_clear(scope);
+}
+
+int persist_reap(time_t timeout) {
+    return file_persist_reap(timeout);
+}
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Kernel keyring backend. Each token is a key of type "user" called
+   "doas:" followed by the name gettokenname() computes, linked into the
+   invoking session's keyring. The key is owned by root, which alone may
+   read or change it, and the kernel expires it once the persist timeout
+   of the rule it was last refreshed under has passed, so nothing is
+   stored on disk and nothing is left behind. Its payload is the time it
+   was last refreshed, for rules with a shorter timeout to check against.
+   This is a Linuxism, and needs no library: the system calls are made
+   directly. */
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/keyctl.h>
+
+#include "bsd-compat/compat.h"
+#include "persist.h"
+
+typedef int32_t key_serial_t;
+
+/* Key permissions, from the kernel's include/linux/key.h */
+#define KEY_POS_VIEW  0x01000000
+#define KEY_USR_ALL   0x003f0000
+
+/* The owner, root, may do anything with a token. Processes in the session
+   may only see that it is there, and not read when it was stamped. */
+#define TOKEN_PERM    (KEY_POS_VIEW | KEY_USR_ALL)
+
+static long keyctl(int op, unsigned long arg2, unsigned long arg3,
+                   unsigned long arg4) {
+    return syscall(SYS_keyctl, op, arg2, arg3, arg4, 0UL);
+}
+
+/* Without a session keyring of its own, a process is given the user's
+   default session keyring, which outlives it, as long as it doesn't ask
+   for one to be created. */
+static key_serial_t sessionkeyring(void) {
+    return keyctl(KEYCTL_GET_KEYRING_ID, KEY_SPEC_SESSION_KEYRING, 0, 0);
+}
+
+/* Only keys made by doas count. Anyone may add a key with the same
+   description to their own session keyring, but it won't be root's. */
+static int rootowned(key_serial_t key) {
+    char buf[512], *p;
+    long r;
+
+    /* The description is "type;uid;gid;perm;description" */
+    if ((r = keyctl(KEYCTL_DESCRIBE, key, (unsigned long)buf,
+                    sizeof(buf))) == -1)
+        return 0;
+    buf[sizeof(buf) - 1] = '\0';
+    if ((p = strchr(buf, ';')) == NULL)
+        return 0;
+    return strncmp(p, ";0;", 3) == 0;
+}
+
+static key_serial_t findkey(key_serial_t keyring, const char *desc) {
+    return keyctl(KEYCTL_SEARCH, keyring, (unsigned long)"user",
+                  (unsigned long)desc);
+}
+
+/* Assumes the process has a controlling tty, unless scope is
+   PERSIST_CGROUP. */
+int persist_check(struct persist *ps, time_t timeout, int scope) {
+    char tsname[PATH_MAX];
+    key_serial_t keyring, key;
+    struct timespec now;
+    int64_t stamp;
+
+    ps->fd = -1;
+    ps->dirfd = -1;
+    ps->stamp = -1;
+    ps->timeout = timeout;
+
+    /* Get the name of the token */
+    if (gettokenname(tsname, sizeof(tsname), scope) == -1)
+        return PERSIST_ERROR;
+
+    if (snprintf(ps->name, sizeof(ps->name), "doas:%s", tsname) >=
+        sizeof(ps->name))
+        return PERSIST_ERROR;
+
+    if ((keyring = sessionkeyring()) == -1)
+        return PERSIST_ERROR;
+
+    if ((key = findkey(keyring, ps->name)) == -1) {
+        switch (errno) {
+        case ENOKEY:
+            return PERSIST_NEW;
+        case EKEYEXPIRED:
+        case EKEYREVOKED:
+            /* The kernel enforces the timeout */
+            return PERSIST_INVALID;
+        default:
+            return PERSIST_ERROR;
+        }
+    }
+
+    if (!rootowned(key))
+        return PERSIST_INVALID;
+
+    /* The key may have been refreshed under a rule with a longer timeout.
+       Keys made before they had a payload are refreshed once. */
+    if (keyctl(KEYCTL_READ, key, (unsigned long)&stamp, sizeof(stamp)) !=
+        sizeof(stamp))
+        return PERSIST_INVALID;
+
+    /* This is a Linuxism. On Linux, CLOCK_MONOTONIC does not run while
+       the machine is suspended. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        return PERSIST_ERROR;
+
+    if (now.tv_sec < stamp || (now.tv_sec - stamp) > timeout)
+        return PERSIST_INVALID;
+
+    ps->stamp = stamp;
+    return PERSIST_OK;
+}
+
+int persist_update(struct persist *ps) {
+    key_serial_t keyring, key;
+    struct timespec now;
+    int64_t stamp;
+
+    /* This is a Linuxism. See above. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        return PERSIST_ERROR;
+    stamp = now.tv_sec;
+
+    if ((keyring = sessionkeyring()) == -1)
+        return PERSIST_ERROR;
+
+    /* An existing token only needs stamping again and its expiry pushing
+       back. Nothing is written to disk to do so, so it is done every
+       time. */
+    if ((key = findkey(keyring, ps->name)) != -1 && rootowned(key)) {
+        if (keyctl(KEYCTL_UPDATE, key, (unsigned long)&stamp,
+                   sizeof(stamp)) == -1 ||
+            keyctl(KEYCTL_SET_TIMEOUT, key, ps->timeout, 0) == -1)
+            return PERSIST_ERROR;
+        return PERSIST_STAMPED;
+    }
+
+    /* Otherwise make a new one in this thread's keyring, which no other
+       process can reach, and only link it into the session keyring once
+       its permissions and timeout are set. Linking it displaces any
+       other key of the same description there. */
+    key = syscall(SYS_add_key, "user", ps->name, &stamp, sizeof(stamp),
+                  KEY_SPEC_THREAD_KEYRING);
+    if (key == -1)
+        return PERSIST_ERROR;
+
+    if (keyctl(KEYCTL_SETPERM, key, TOKEN_PERM, 0) == -1 ||
+        keyctl(KEYCTL_SET_TIMEOUT, key, ps->timeout, 0) == -1 ||
+        keyctl(KEYCTL_LINK, key, keyring, 0) == -1) {
+        (void) keyctl(KEYCTL_INVALIDATE, key, 0, 0);
+        return PERSIST_ERROR;
+    }
+
+    return PERSIST_STAMPED;
+}
+
+void persist_commit(struct persist *ps) {
+    /* Nothing to do, the key is linked by persist_update() */
+    (void) ps;
+}
+
+int persist_clear(int scope) {
+    char tsname[PATH_MAX], desc[PATH_MAX];
+    key_serial_t keyring, key;
+
+    if (gettokenname(tsname, sizeof(tsname), scope) == -1)
+        return -1;
+
+    if (snprintf(desc, sizeof(desc), "doas:%s", tsname) >= sizeof(desc))
+        return -1;
+
+    if ((keyring = sessionkeyring()) == -1)
+        return -1;
+
+    if ((key = findkey(keyring, desc)) == -1)
+        return (errno == ENOKEY || errno == EKEYEXPIRED ||
+                errno == EKEYREVOKED) ? 0 : -1;
+
+    if (!rootowned(key))
+        return 0;
+
+    return keyctl(KEYCTL_INVALIDATE, key, 0, 0) == -1 ? -1 : 0;
+}
+
+int persist_reap(time_t timeout) {
+    /* Nothing to do, the kernel removes expired keys itself */
+    (void) timeout;
+    return 0;
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Token table backend. Rather than a file per session, every token is a
+   slot in one fixed-size table file in the state directory, found by
+   hashing the name gettokenname() computes. Checks take a shared lock on
+   the table and read the slots the name may be in, about a page, and
+   updates take an exclusive lock and rewrite the one slot, so no file is
+   ever created, renamed or synchronously written once the table exists.
+   Positioned reads and writes are used rather than mapping the table,
+   which for a single lookup costs far more than it saves. */
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bsd-compat/compat.h"
+#include "persist.h"
+
+#ifndef DOAS_PERSIST_SLOTS
+#define DOAS_PERSIST_SLOTS 4096
+#endif
+
+#define TABLE_NAME    "tokens"
+#define TABLE_MAGIC   "DOASTOK"
+#define TABLE_VERSION 1
+
+/* The number of consecutive slots a name may be stored in, starting from
+   its hash. All of them are read on every lookup. */
+#define PROBE_SLOTS   32
+
+#if DOAS_PERSIST_SLOTS < PROBE_SLOTS
+#error "PERSIST_SLOTS is too small"
+#endif
+
+struct slot {
+    char name[120];         /* token name, empty if the slot is free */
+    int64_t stamp;          /* CLOCK_BOOTTIME seconds at last auth */
+};
+
+/* The header takes the place of slot 0. */
+struct table_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    char pad[sizeof(struct slot) - 16];
+};
+
+#define TABLE_SIZE    (sizeof(struct slot) * (DOAS_PERSIST_SLOTS + 1))
+#define SLOT_OFFSET(i) ((off_t)sizeof(struct slot) * ((i) + 1))
+
+/* The slots which may hold one name. */
+struct window {
+    size_t first;
+    struct slot slots[PROBE_SLOTS];
+};
+
+static int lockfd(int fd, int op) {
+    while (flock(fd, op) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/* Open the token table in the state directory, creating it if need be. */
+static int opentable(void) {
+    int fd, sfd;
+
+    if ((sfd = openstatedir(0)) == -1)
+        return -1;
+
+    fd = openat(sfd, TABLE_NAME, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+    close(sfd);
+    return fd;
+}
+
+/* Lock the table open on fd with the given flock(2) operation and check
+   it. A table which is new, or which was made by a build with a different
+   number of slots, is emptied first. */
+static int locktable(int fd, int lock) {
+    struct table_header hdr;
+    struct stat nodeinfo;
+    int locked = lock;
+
+    if (lockfd(fd, lock) == -1)
+        return -1;
+
+    for (;;) {
+        if (fstat(fd, &nodeinfo) == -1)
+            goto unlock;
+
+        if (nodeinfo.st_uid != 0 || nodeinfo.st_gid != 0 ||
+            (nodeinfo.st_mode & ~(S_IRUSR | S_IWUSR)) != S_IFREG)
+            goto unlock;
+
+        if (nodeinfo.st_size == TABLE_SIZE &&
+            pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            memcmp(hdr.magic, TABLE_MAGIC, sizeof(hdr.magic)) == 0 &&
+            hdr.version == TABLE_VERSION && hdr.nslots == DOAS_PERSIST_SLOTS)
+            break;
+
+        if (locked != LOCK_EX) {
+            if (lockfd(fd, LOCK_EX) == -1)
+                goto unlock;
+            locked = LOCK_EX;
+            continue;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TABLE_MAGIC, sizeof(hdr.magic));
+        hdr.version = TABLE_VERSION;
+        hdr.nslots = DOAS_PERSIST_SLOTS;
+        if (fchmod(fd, S_IRUSR | S_IWUSR) == -1 || ftruncate(fd, 0) == -1 ||
+            ftruncate(fd, TABLE_SIZE) == -1 ||
+            pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto unlock;
+    }
+
+    if (locked != lock && lockfd(fd, lock) == -1)
+        goto unlock;
+
+    return 0;
+
+unlock:
+    (void) flock(fd, LOCK_UN);
+    return -1;
+}
+
+/* Read the slots which may hold the token called name. The table must be
+   locked. */
+static int readwindow(int fd, const char *name, struct window *w) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    w->first = h % (DOAS_PERSIST_SLOTS - PROBE_SLOTS + 1);
+
+    if (pread(fd, w->slots, sizeof(w->slots), SLOT_OFFSET(w->first)) !=
+        sizeof(w->slots))
+        return -1;
+    return 0;
+}
+
+/* Find the slot holding the token called name. If there is none and claim
+   is set, return the slot to store it in instead: a free one if there is
+   one, otherwise the one holding the oldest token. */
+static struct slot *findslot(struct window *w, const char *name,
+                             int64_t now, int claim) {
+    struct slot *s, *victim = NULL;
+    int64_t key, victimkey = 0;
+    size_t i;
+
+    for (i = 0; i < PROBE_SLOTS; i++) {
+        s = &w->slots[i];
+        if (strncmp(s->name, name, sizeof(s->name)) == 0)
+            return s;
+
+        /* A stamp in the future is invalid, so the slot is as good as
+           free */
+        key = (s->name[0] == '\0' || s->stamp > now) ? INT64_MIN : s->stamp;
+        if (victim == NULL || key < victimkey) {
+            victim = s;
+            victimkey = key;
+        }
+    }
+
+    return claim ? victim : NULL;
+}
+
+static int writeslot(int fd, struct window *w, struct slot *s) {
+    off_t off = SLOT_OFFSET(w->first + (s - w->slots));
+
+    return pwrite(fd, s, sizeof(*s), off) == sizeof(*s) ? 0 : -1;
+}
+
+/* Assumes the process has a controlling tty, unless scope is
+   PERSIST_CGROUP. */
+int persist_check(struct persist *ps, time_t timeout, int scope) {
+    struct window w;
+    struct slot *s;
+    struct timespec now;
+    int rv;
+
+    ps->dirfd = -1;
+    ps->stamp = -1;
+    ps->timeout = timeout;
+
+    /* Get the name of the token */
+    if (gettokenname(ps->name, sizeof(ps->name), scope) == -1 ||
+        strlen(ps->name) >= sizeof(s->name))
+        return PERSIST_ERROR;
+
+    /* This is a Linuxism. On Linux, CLOCK_MONOTONIC does not run while
+       the machine is suspended. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        return PERSIST_ERROR;
+
+    if ((ps->fd = opentable()) == -1)
+        return PERSIST_ERROR;
+
+    if (locktable(ps->fd, LOCK_SH) == -1) {
+        close(ps->fd);
+        return PERSIST_ERROR;
+    }
+
+    if (readwindow(ps->fd, ps->name, &w) == -1) {
+        rv = PERSIST_ERROR;
+    } else if ((s = findslot(&w, ps->name, now.tv_sec, 0)) == NULL) {
+        /* No token yet; one is stored once authentication succeeds */
+        rv = PERSIST_NEW;
+    } else if (now.tv_sec < s->stamp) {
+        /* Timestamp is in future, and is thus invalid */
+        rv = PERSIST_INVALID;
+    } else if ((now.tv_sec - s->stamp) > timeout) {
+        /* Difference between now and the timestamp is greater than the
+           configured timeout */
+        rv = PERSIST_INVALID;
+    } else {
+        /* Timestamp is within the timeout */
+        ps->stamp = s->stamp;
+        rv = PERSIST_OK;
+    }
+
+    (void) flock(ps->fd, LOCK_UN);
+    if (rv == PERSIST_ERROR)
+        close(ps->fd);
+    return rv;
+}
+
+int persist_update(struct persist *ps) {
+    struct window w;
+    struct slot *s;
+    struct timespec now;
+    int r = PERSIST_ERROR;
+
+    /* This is a Linuxism. See above. A valid token which was stamped
+       recently enough is left as it is, saving a write. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1) {
+        close(ps->fd);
+        return PERSIST_ERROR;
+    }
+
+    if (stampfresh(ps, now.tv_sec)) {
+        close(ps->fd);
+        return PERSIST_FRESH;
+    }
+
+    /* The table was checked by persist_check(), and is never made smaller
+       once it has been */
+    if (lockfd(ps->fd, LOCK_EX) == -1) {
+        close(ps->fd);
+        return PERSIST_ERROR;
+    }
+
+    /* The slot is looked up again, as it may have been given to another
+       session while the password was being read */
+    if (readwindow(ps->fd, ps->name, &w) == 0) {
+        s = findslot(&w, ps->name, now.tv_sec, 1);
+        if (strncmp(s->name, ps->name, sizeof(s->name)) != 0) {
+            memset(s->name, 0, sizeof(s->name));
+            strlcpy(s->name, ps->name, sizeof(s->name));
+        }
+        s->stamp = now.tv_sec;
+        if (writeslot(ps->fd, &w, s) == 0)
+            r = PERSIST_STAMPED;
+    }
+
+    (void) flock(ps->fd, LOCK_UN);
+    close(ps->fd);
+    return r;
+}
+
+void persist_commit(struct persist *ps) {
+    /* Nothing to do, the slot is stored by persist_update() */
+    (void) ps;
+}
+
+int persist_clear(int scope) {
+    char tsname[PATH_MAX];
+    struct window w;
+    struct slot *s;
+    int fd, r = 0;
+
+    if (gettokenname(tsname, sizeof(tsname), scope) == -1)
+        return -1;
+
+    if ((fd = opentable()) == -1)
+        return -1;
+
+    if (locktable(fd, LOCK_EX) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (readwindow(fd, tsname, &w) == -1) {
+        r = -1;
+    } else if ((s = findslot(&w, tsname, 0, 0)) != NULL) {
+        memset(s, 0, sizeof(*s));
+        r = writeslot(fd, &w, s);
+    }
+
+    (void) flock(fd, LOCK_UN);
+    close(fd);
+    return r;
+}
+
+/* Empty every slot holding a token older than timeout or which can no
+   longer be used. */
+int persist_reap(time_t timeout) {
+    struct slot slots[PROBE_SLOTS];
+    struct timespec now;
+    size_t i, j, n;
+    int fd, r = 0;
+
+    /* This is a Linuxism. See above. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        return -1;
+
+    if ((fd = opentable()) == -1)
+        return -1;
+
+    if (locktable(fd, LOCK_EX) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    for (i = 0; i < DOAS_PERSIST_SLOTS; i += n) {
+        n = DOAS_PERSIST_SLOTS - i < PROBE_SLOTS ?
+            DOAS_PERSIST_SLOTS - i : PROBE_SLOTS;
+        if (pread(fd, slots, n * sizeof(*slots), SLOT_OFFSET(i)) !=
+            n * sizeof(*slots)) {
+            r = -1;
+            break;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (slots[j].name[0] == '\0')
+                continue;
+            slots[j].name[sizeof(slots[j].name) - 1] = '\0';
+            if (!staletoken(slots[j].name, slots[j].stamp, now.tv_sec,
+                            timeout))
+                continue;
+            memset(&slots[j], 0, sizeof(slots[j]));
+            if (pwrite(fd, &slots[j], sizeof(slots[j]),
+                       SLOT_OFFSET(i + j)) != sizeof(slots[j]))
+                r = -1;
+        }
+    }
+
+    (void) flock(fd, LOCK_UN);
+    close(fd);
+    return r;
+}
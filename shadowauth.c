@@ -14,33 +14,161 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef DOAS_LAZY_CRYPT
+#include <dlfcn.h>
+#include <err.h>
+#else
 #include <crypt.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
 #include <shadow.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "bsd-compat/compat.h"
+#include "shadowauth.h"
+
+#ifndef DOAS_LIBCRYPT
+#define DOAS_LIBCRYPT "libcrypt.so.1"
+#endif
+
+const char *shadow_file = DOAS_SHADOW_FILE;
+
+typedef char *(*cryptfn)(const char *, const char *);
+
+/* Find crypt(3). With LAZY_CRYPT, libcrypt and whatever it depends on are
+   only loaded once a password has to be checked, so that invocations which
+   need none don't pay for loading them at startup. */
+static cryptfn getcrypt(void) {
+#ifdef DOAS_LAZY_CRYPT
+    static cryptfn fn;
+    void *lib;
+
+    if (fn != NULL)
+        return fn;
+
+    if ((lib = dlopen(DOAS_LIBCRYPT, RTLD_NOW | RTLD_LOCAL)) == NULL ||
+        (fn = (cryptfn)dlsym(lib, "crypt")) == NULL)
+        warnx("%s", dlerror());
+
+    return fn;
+#else
+    return crypt;
+#endif
+}
+
+/* Find the password hash of user u in shadow_file by looking for their
+   name at the start of each line of the mapped file, rather than parsing
+   every line before theirs, as NSS does. Returns a copy of the hash, or
+   NULL if there is no such line or the file can't be read. */
+char *shadowscan(const char *u) {
+    struct stat sb;
+    size_t ulen = strlen(u);
+    char *map, *end, *p, *nl, *line = NULL, *hash, *hend;
+    int fd;
+
+    if ((fd = open(shadow_file, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+    if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    end = map + sb.st_size;
+
+    /* Try the start of every line in turn: memchr() gets from one to the
+       next faster than memmem() finds the name among lines much alike */
+    for (p = map; p < end; p = nl + 1) {
+        if ((size_t)(end - p) > ulen && memcmp(p, u, ulen) == 0 &&
+            p[ulen] == ':') {
+            line = p;
+            break;
+        }
+        if ((nl = memchr(p, '\n', end - p)) == NULL)
+            break;
+    }
+
+    hash = NULL;
+    if (line != NULL) {
+        line += ulen + 1;
+        for (hend = line; hend < end && *hend != ':' && *hend != '\n'; hend++)
+            ;
+        hash = strndup(line, hend - line);
+    }
 
-int shadowauth(const char *u, const char *p) {
-    struct spwd *spw = NULL;
+    munmap(map, sb.st_size);
+    return hash;
+}
+
+/* Look up the password hash of user u, once for every attempt to
+   authenticate them. Returns a copy to be passed to shadowauth() and
+   given back to shadowwipe(), or NULL if they have none. With
+   DOAS_SHADOW_SCAN, shadow_file is searched before NSS whatever order
+   nsswitch.conf gives, so a user also in LDAP or sss gets the local hash. */
+char *shadowlookup(const char *u) {
+    struct spwd *spw;
+    char *hash;
+
+#ifdef DOAS_SHADOW_SCAN
+    if ((hash = shadowscan(u)) != NULL)
+        return hash;
+#endif
+
+    if ((spw = getspnam(u)) == NULL)
+        return NULL;
+
+    hash = strdup(spw->sp_pwdp);
+    explicit_bzero(spw->sp_pwdp, strlen(spw->sp_pwdp));
+    explicit_bzero(spw, sizeof(struct spwd));
+
+    return hash;
+}
+
+/* Wipe and free a hash from shadowlookup(). */
+void shadowwipe(char *hash) {
+    if (hash == NULL)
+        return;
+
+    explicit_bzero(hash, strlen(hash));
+    free(hash);
+}
+
+/* Check password p against hash, from shadowlookup(). The time crypt(3)
+   took, in microseconds, is stored in usec, or -1 if it wasn't called. */
+int shadowauth(const char *hash, const char *p, long *usec) {
+    struct timespec start, end;
     char *res = NULL;
+    cryptfn cryptp;
 
-    if ((spw = getspnam(u)) == NULL) {
+    *usec = -1;
+
+    if (hash == NULL || (cryptp = getcrypt()) == NULL) {
         return 1;
     }
 
-    if ((res = crypt(p, spw->sp_pwdp)) == NULL) {
-        explicit_bzero(spw, sizeof(struct spwd));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = cryptp(p, hash);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *usec = (end.tv_sec - start.tv_sec) * 1000000L +
+            (end.tv_nsec - start.tv_nsec) / 1000;
+
+    if (res == NULL) {
         return 1;
     }
 
-    if (strcmp(res, spw->sp_pwdp) != 0) {
-        explicit_bzero(spw, sizeof(struct spwd));
+    if (strcmp(res, hash) != 0) {
         explicit_bzero(res, strlen(res));
         return 1;
     }
 
-    explicit_bzero(spw, sizeof(struct spwd));
     explicit_bzero(res, strlen(res));
 
     return 0;
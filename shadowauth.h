@@ -17,6 +17,15 @@
 #ifndef _SHADOWAUTH_H
 #define _SHADOWAUTH_H
 
-int shadowauth (const char *u, const char *p);
+#ifndef DOAS_SHADOW_FILE
+#define DOAS_SHADOW_FILE "/etc/shadow"
+#endif
+
+extern const char *shadow_file;
+
+char *shadowscan(const char *u);
+char *shadowlookup(const char *u);
+void shadowwipe(char *hash);
+int shadowauth (const char *hash, const char *p, long *usec);
 
 #endif /* _SHADOWAUTH_H */
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Throttling of password checks. Each check is a crypt(3) of the user's
+   hash, which may be made deliberately expensive, so a user may only have
+   DOAS_AUTH_BUDGET of them in DOAS_AUTH_WINDOW seconds, however many
+   invocations of doas they start at once. A window in which the budget
+   was used up, followed straight away by another attempt, makes the next
+   window twice as long, up to MAX_STRIKES times over, so that a user who
+   keeps guessing is slowed down further and further. A successful check
+   starts the count again. The count is kept in a file per user, named
+   after their uid, in the "auth" directory below the state directory,
+   which is created if need be. If it can't be, checks are not throttled,
+   but this is logged, since it leaves crypt(3) open to a flood. */
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "persist.h"
+#include "throttle.h"
+
+/* How long to wait for another invocation to let go of a count, in
+   milliseconds. It is only held across a read and a write, so a longer
+   wait means its holder has been stopped, which a user can do to their
+   own doas. */
+#define LOCK_WAIT 1000
+
+/* How many times over a window may be doubled */
+#define MAX_STRIKES 6
+
+struct authcount {
+    int64_t start;          /* when the window began */
+    int32_t count;          /* passwords checked in it */
+    int32_t strikes;        /* windows used up just before it */
+};
+
+/* The length of a window after so many used up ones. */
+static time_t window(int32_t strikes) {
+    return (time_t) DOAS_AUTH_WINDOW <<
+           (strikes < MAX_STRIKES ? strikes : MAX_STRIKES);
+}
+
+/* Lock the count on fd, waiting at most LOCK_WAIT for it rather than as
+   long as its holder likes. Fails with EWOULDBLOCK if it is still held. */
+static int lockcount(int fd) {
+    struct timespec step = { 0, 1000000 };
+    int i;
+
+    for (i = 0; i < LOCK_WAIT; i++) {
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+            return 0;
+        if (errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        (void) nanosleep(&step, NULL);
+    }
+    errno = EWOULDBLOCK;
+    return -1;
+}
+
+/* Open and lock the invoking user's count, creating it if need be. */
+static int opencount(void) {
+    struct stat nodeinfo;
+    char name[32];
+    int sfd, dirfd, fd, e;
+
+    if (snprintf(name, sizeof(name), "%u", getuid()) >= sizeof(name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* The count is kept whichever backend is used, so the state directory
+       may not have been made for tokens */
+    if ((sfd = openstatedir(1)) == -1)
+        return -1;
+    dirfd = openstatedirat(sfd, "auth", 1);
+    close(sfd);
+    if (dirfd == -1)
+        return -1;
+
+    fd = openat(dirfd, name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+    close(dirfd);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &nodeinfo) == -1)
+        goto closefd;
+    if (nodeinfo.st_uid != 0 || !S_ISREG(nodeinfo.st_mode)) {
+        errno = EPERM;
+        goto closefd;
+    }
+
+    /* The group of a new file is that of the invoking user unless doas is
+       also setgid, and its mode is subject to the umask */
+    if (nodeinfo.st_gid != 0 && fchown(fd, 0, 0) == -1)
+        goto closefd;
+    if ((nodeinfo.st_mode & ~S_IFMT) != (S_IRUSR | S_IWUSR) &&
+        fchmod(fd, S_IRUSR | S_IWUSR) == -1)
+        goto closefd;
+
+    if (lockcount(fd) == -1)
+        goto closefd;
+
+    return fd;
+
+closefd:
+    e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+}
+
+/* Decide whether the invoking user may have a password checked now. If
+   charge is set, the check is counted, before it is made, so that checks
+   made at once by many invocations can't all get in under the budget.
+   Returns 1 if the user has used up their budget, with the number of
+   seconds until the next window in wait, and 0 otherwise. A count which
+   stays locked is taken as used up, for a second, since going ahead
+   without it would let a user lift their budget by stopping a doas. */
+int throttle(int charge, time_t *wait) {
+    static int warned;
+    struct authcount c;
+    struct timespec now;
+    int fd, r = 0;
+
+    if (DOAS_AUTH_BUDGET == 0)
+        return 0;
+
+    if ((fd = opencount()) == -1) {
+        if (errno == EWOULDBLOCK) {
+            *wait = 1;
+            return 1;
+        }
+        if (!warned++)
+            syslog(LOG_AUTHPRIV | LOG_WARNING,
+                   "password checks are not throttled, can't use %s/auth: %m",
+                   persist_state_dir);
+        return 0;
+    }
+
+    /* This is a Linuxism. On Linux, CLOCK_MONOTONIC does not run while
+       the machine is suspended. */
+    if (clock_gettime(CLOCK_BOOTTIME, &now) == -1)
+        goto done;
+
+    if (pread(fd, &c, sizeof(c), 0) != sizeof(c) || now.tv_sec < c.start ||
+        c.count < 0 || c.strikes < 0) {
+        c.start = now.tv_sec;
+        c.count = 0;
+        c.strikes = 0;
+    } else if (now.tv_sec - c.start >= window(c.strikes)) {
+        /* Back off from a user who used up the last window and is back
+           before another has passed, but forgive one who stayed away */
+        if (c.count >= DOAS_AUTH_BUDGET &&
+            now.tv_sec - c.start < 2 * window(c.strikes))
+            c.strikes = c.strikes < MAX_STRIKES ? c.strikes + 1 : MAX_STRIKES;
+        else
+            c.strikes = 0;
+        c.start = now.tv_sec;
+        c.count = 0;
+    }
+
+    if (c.count >= DOAS_AUTH_BUDGET) {
+        *wait = c.start + window(c.strikes) - now.tv_sec;
+        r = 1;
+    } else if (charge) {
+        c.count++;
+        (void) pwrite(fd, &c, sizeof(c), 0);
+    }
+
+done:
+    close(fd);
+    return r;
+}
+
+/* Start the invoking user's count again, after a successful check. */
+void throttle_clear(void) {
+    int fd;
+
+    if (DOAS_AUTH_BUDGET == 0)
+        return;
+
+    if ((fd = opencount()) == -1)
+        return;
+    (void) ftruncate(fd, 0);
+    close(fd);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2026 multi <multi@in-addr.xyz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _THROTTLE_H
+#define _THROTTLE_H
+
+#include <time.h>
+
+/* How many passwords each user may have checked in a window of so many
+   seconds, however many invocations they are spread over. A budget of 0
+   turns throttling off. */
+#ifndef DOAS_AUTH_BUDGET
+#define DOAS_AUTH_BUDGET 10
+#endif
+
+#ifndef DOAS_AUTH_WINDOW
+#define DOAS_AUTH_WINDOW 60
+#endif
+
+int throttle(int, time_t *);
+void throttle_clear(void);
+
+#endif /* _THROTTLE_H */